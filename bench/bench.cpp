@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "eval/async_evaluator.h"
+#include "eval/column_file.h"
+#include "eval/evaluator.h"
+#include "eval/task_pool.h"
+
+namespace
+{
+
+template <typename F>
+double time_ms(F&& f)
+{
+	const auto start = std::chrono::steady_clock::now();
+	f();
+	const auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+eval::evaluator_t make_evaluator()
+{
+	eval::evaluator_t evaluate;
+
+	evaluate.add_operator(eval::operators::add);
+	evaluate.add_operator(eval::operators::subtract);
+	evaluate.add_operator(eval::operators::multiply);
+	evaluate.add_operator(eval::operators::divide);
+	evaluate.add_operator(eval::operators::less);
+	evaluate.add_operator(eval::operators::greater);
+	evaluate.add_operator(eval::operators::equal);
+
+	evaluate.add_unary(eval::unary::plus);
+	evaluate.add_unary(eval::unary::minus);
+	evaluate.add_unary(eval::unary::percent);
+
+	evaluate.add_function(eval::functions::abs);
+	evaluate.add_function(eval::functions::sqrt);
+	evaluate.add_function(eval::functions::pow);
+	evaluate.add_function(eval::functions::log);
+	evaluate.add_function(eval::functions::exp);
+	evaluate.add_function(eval::functions::select);
+
+	evaluate.add_constant(eval::constants::pi);
+	evaluate.add_constant(eval::constants::e);
+
+	evaluate.add_variable("x");
+	evaluate.associate_pipe_with_implicit_function("abs");
+
+	return evaluate;
+}
+
+// -----------------------------------------------------------------------------
+
+// long flat sums, the shape a code generator tends to produce
+std::string make_wide_expression(const size_t length)
+{
+	std::string expression = "1";
+	for (size_t i = 0; expression.size() < length; i++)
+		expression += (i % 2 == 0) ? " + x*1.5 - sqrt(x + 2)/3" : " + pow(x, 2)*-e + |x - pi|";
+	return expression;
+}
+
+// deeply bracketed, the worst case for the auxiliary stacks
+std::string make_deep_expression(const size_t depth)
+{
+	std::string expression;
+	for (size_t i = 0; i < depth; i++)
+		expression += "(x+";
+	expression += "1";
+	for (size_t i = 0; i < depth; i++)
+		expression += ")";
+	return expression;
+}
+
+void bench_scaling(const eval::evaluator_t& evaluate)
+{
+	std::cout << "scaling, wide expressions" << std::endl;
+	std::cout << "       bytes   instructions   compile ms   evaluate ms   ns/byte" << std::endl;
+
+	const double x = 0.75;
+
+	for (size_t length = 1 << 20; length <= (1 << 24); length <<= 1)
+	{
+		const std::string expression = make_wide_expression(length);
+
+		eval::program_t program;
+		const double compile_ms = time_ms([&] { program = evaluate.compile(expression); });
+
+		double result = 0;
+		const double evaluate_ms = time_ms([&] { result = evaluate.evaluate(program, &x); });
+
+		printf("%12llu %14llu %12.2f %13.2f %9.2f\n", (unsigned long long)expression.size(),
+			(unsigned long long)program.m_instructions.size(), compile_ms, evaluate_ms,
+			(compile_ms + evaluate_ms) * 1e6 / expression.size());
+	}
+
+	std::cout << std::endl << "scaling, nested expressions" << std::endl;
+	std::cout << "       depth     stack size   compile ms   evaluate ms" << std::endl;
+
+	for (size_t depth = 1 << 16; depth <= (1 << 20); depth <<= 2)
+	{
+		const std::string expression = make_deep_expression(depth);
+
+		eval::program_t program;
+		const double compile_ms = time_ms([&] { program = evaluate.compile(expression); });
+		const double evaluate_ms = time_ms([&] { evaluate.evaluate(program, &x); });
+
+		printf("%12llu %14llu %12.2f %13.2f\n", (unsigned long long)depth,
+			(unsigned long long)program.m_stack_size, compile_ms, evaluate_ms);
+	}
+
+	std::cout << std::endl;
+}
+
+
+// -----------------------------------------------------------------------------
+
+void bench_dispatch(eval::evaluator_t evaluate)
+{
+	std::cout << "dispatch, stock operators and functions" << std::endl;
+	std::cout << "  expression                                                portable ns   threaded ns" << std::endl;
+
+	const char* const expressions[] = {
+		"1 + 2*x - 3/x",
+		"(1 + sqrt(5))/2 * x - -x%",
+		"pow(x, 3) - 2*pow(x, 2) + log(x + 1)*exp(-x) - |x - pi|",
+		"x*(x*(x*(x*(x*(x + 1) - 2) + 3) - 4) + 5) - 6/(x + e)",
+	};
+
+	const size_t iterations = 1 << 20;
+
+	for (const char* const expression : expressions)
+	{
+		const eval::program_t program = evaluate.compile(expression);
+
+		double ns[2];
+		const eval::dispatch_t dispatches[2] = { eval::dispatch_t::portable, eval::dispatch_t::threaded };
+
+		for (int d = 0; d < 2; d++)
+		{
+			evaluate.set_dispatch(dispatches[d]);
+
+			volatile double sink = 0;
+			ns[d] = time_ms([&] {
+				for (size_t i = 0; i < iterations; i++)
+				{
+					const double x = 0.5 + (i & 255) * 0.01;
+					sink = sink + evaluate.evaluate(program, &x);
+				}
+			}) * 1e6 / iterations;
+		}
+
+		printf("  %-56s %11.1f %13.1f\n", expression, ns[0], ns[1]);
+	}
+
+	std::cout << std::endl;
+}
+
+
+// -----------------------------------------------------------------------------
+
+void bench_lexer(eval::evaluator_t evaluate)
+{
+	std::cout << "lexer, parsing lots of stored formulas" << std::endl;
+	std::cout << "  formulas                     scalar ms   simd ms" << std::endl;
+
+	evaluate.add_variable("regionalAdjustmentFactor");
+	evaluate.add_variable("baseRatePerAnnum");
+
+	const char* const styles[] = {
+		"x*1.5 - sqrt(x + 2)/3 + pow(x, 2)*-e",
+		"regionalAdjustmentFactor * pow(1 + baseRatePerAnnum, 10) - baseRatePerAnnum",
+		"    x          *   1.5\n  - sqrt(  x + 2  )   /  3\n\t\t+ pow( x,  2 ) * -e    ",
+	};
+	const char* const names[] = { "compact", "long identifiers", "heavily indented" };
+
+	for (int style = 0; style < 3; style++)
+	{
+		const std::vector<std::string> formulas(100000, styles[style]);
+
+		double ms[2] = { std::numeric_limits<double>::max(), std::numeric_limits<double>::max() };
+		const eval::lexer_t lexers[2] = { eval::lexer_t::scalar, eval::lexer_t::simd };
+
+		// the best of a few runs, taking turns, so a noisy machine hits both alike
+		for (int run = 0; run < 5; run++)
+		{
+			for (int l = 0; l < 2; l++)
+			{
+				evaluate.set_lexer(lexers[l]);
+				ms[l] = std::min(ms[l], time_ms([&] {
+					for (const std::string& formula : formulas)
+						evaluate.compile(formula);
+				}));
+			}
+		}
+
+		printf("  %-28s %9.2f %9.2f\n", names[style], ms[0], ms[1]);
+	}
+
+	std::cout << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+
+void bench_precision(eval::evaluator_t evaluate)
+{
+	std::cout << "precision, fast against exact" << std::endl;
+	std::cout << "  function    max rel error   exact ns   fast ns   exact batch ns   fast batch ns" << std::endl;
+
+	struct case_t
+	{
+		const char* m_name;
+		const char* m_expression;
+		double m_x_low, m_x_high;
+	};
+
+	const case_t cases[] = {
+		{ "exp", "exp(x)", -700, 700 },
+		{ "log", "log(x)", 1e-6, 1e6 },
+	};
+
+	const size_t rows = 1 << 20;
+	std::vector<double> x(rows), exact(rows), fast(rows);
+
+	std::mt19937_64 rng(1);
+
+	for (const case_t& c : cases)
+	{
+		std::uniform_real_distribution<double> x_dist(0, 1);
+		for (size_t r = 0; r < rows; r++)
+		{
+			// spread logarithmically where the range is all positive
+			const double u = x_dist(rng);
+			x[r] = c.m_x_low > 0 ? c.m_x_low * std::pow(c.m_x_high / c.m_x_low, u) : c.m_x_low + (c.m_x_high - c.m_x_low) * u;
+		}
+
+		const double* const columns[] = { x.data() };
+		const eval::program_t program = evaluate.compile(c.m_expression);
+
+		double scalar_ns[2], batch_ns[2];
+		const eval::precision_t precisions[2] = { eval::precision_t::exact, eval::precision_t::fast };
+		std::vector<double>* const outputs[2] = { &exact, &fast };
+
+		for (int p = 0; p < 2; p++)
+		{
+			evaluate.set_precision(precisions[p]);
+
+			scalar_ns[p] = time_ms([&] {
+				for (size_t r = 0; r < rows; r++)
+					(*outputs[p])[r] = evaluate.evaluate(program, &x[r]);
+			}) * 1e6 / rows;
+
+			batch_ns[p] = time_ms([&] { evaluate.evaluate(program, rows, columns, outputs[p]->data()); }) * 1e6 / rows;
+		}
+
+		double max_error = 0;
+		for (size_t r = 0; r < rows; r++)
+		{
+			if (std::isfinite(exact[r]) && exact[r] != 0)
+				max_error = std::max(max_error, std::abs(fast[r] / exact[r] - 1));
+		}
+
+		printf("  %-10s %14.2e %10.1f %9.1f %16.1f %15.1f\n", c.m_name, max_error, scalar_ns[0], scalar_ns[1], batch_ns[0], batch_ns[1]);
+	}
+
+	std::cout << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+
+void bench_select(const eval::evaluator_t& evaluate)
+{
+	std::cout << "select, a piecewise formula" << std::endl;
+	std::cout << "  form                                                                          ns   batch ns" << std::endl;
+
+	// the same three pieces, picked with select, and with comparisons as masks
+	const char* const expressions[] = {
+		"select(x < 1, x*x, select(x < 3, 2*x - 1, x + 2))",
+		"(x < 1)*(x*x) + ((x < 1) = 0)*(x < 3)*(2*x - 1) + ((x < 3) = 0)*(x + 2)",
+	};
+
+	const size_t rows = 1 << 20;
+	std::vector<double> x(rows), results(rows);
+	for (size_t r = 0; r < rows; r++)
+		x[r] = (r * 2654435761u % 1000) * 0.005;
+
+	const double* const columns[] = { x.data() };
+
+	for (const char* const expression : expressions)
+	{
+		const eval::program_t program = evaluate.compile(expression);
+
+		const double scalar_ns = time_ms([&] {
+			for (size_t r = 0; r < rows; r++)
+				results[r] = evaluate.evaluate(program, &x[r]);
+		}) * 1e6 / rows;
+
+		const double batch_ns = time_ms([&] { evaluate.evaluate(program, rows, columns, results.data()); }) * 1e6 / rows;
+
+		printf("  %-72s %7.1f %10.1f\n", expression, scalar_ns, batch_ns);
+	}
+
+	std::cout << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+
+// the same inputs read back from csv and evaluated a row at a time, against
+// evaluating straight from a mapped column file
+void bench_columns(eval::evaluator_t evaluate)
+{
+	evaluate.add_variable("y");
+
+	const size_t rows = 1 << 20;
+	const char* const csv_path = "bench_inputs.csv";
+	const char* const input_path = "bench_inputs.col";
+	const char* const output_path = "bench_outputs.col";
+
+	std::cout << "columns, " << rows << " rows of x and y" << std::endl;
+	std::cout << "  input                    ms" << std::endl;
+
+	std::vector<double> x(rows), y(rows), results(rows);
+	for (size_t r = 0; r < rows; r++)
+	{
+		x[r] = 1 + (r * 2654435761u % 100000) * 1e-3;
+		y[r] = (r % 1000) * 0.25 - 100;
+	}
+
+	{
+		FILE* csv = nullptr;
+		if (fopen_s(&csv, csv_path, "w") != 0 || csv == nullptr)
+		{
+			std::cout << "  couldn't create " << csv_path << ", skipped" << std::endl << std::endl;
+			return;
+		}
+
+		fprintf(csv, "x,y\n");
+		for (size_t r = 0; r < rows; r++)
+			fprintf(csv, "%.17g,%.17g\n", x[r], y[r]);
+		fclose(csv);
+
+		const double* const columns[] = { x.data(), y.data() };
+		eval::write_column_file(input_path, rows, { "x", "y" }, columns);
+	}
+
+	const eval::program_t program = evaluate.compile("x*log(x) + select(y > 0, sqrt(y), -y)/2");
+
+	bool csv_read = false;
+	const double csv_ms = time_ms([&] {
+		FILE* csv = nullptr;
+		if (fopen_s(&csv, csv_path, "r") != 0 || csv == nullptr)
+			return;
+		csv_read = true;
+
+		char line[128];
+		fgets(line, sizeof(line), csv);
+		for (size_t r = 0; fgets(line, sizeof(line), csv) != nullptr; r++)
+		{
+			char* end;
+			double variables[2];
+			variables[0] = strtod(line, &end);
+			variables[1] = strtod(end + 1, nullptr);
+			results[r] = evaluate.evaluate(program, variables);
+		}
+		fclose(csv);
+	});
+
+	const double mapped_ms = time_ms([&] {
+		eval::evaluate_column_file(evaluate, input_path, { { "z", program } }, output_path);
+	});
+
+	if (!csv_read)
+	{
+		std::cout << "  couldn't read " << csv_path << " back" << std::endl;
+		printf("  mapped column file   %10.1f\n", mapped_ms);
+	}
+	else
+	{
+		// make sure they agree
+		bool identical;
+		{
+			const eval::column_file_t output(output_path);
+			identical = std::memcmp(output.column_data(0), results.data(), rows * sizeof(double)) == 0;
+		}
+
+		printf("  csv, a row at a time %10.1f\n", csv_ms);
+		printf("  mapped column file   %10.1f   %s\n", mapped_ms, identical ? "identical" : "DIFFERENT");
+	}
+
+	remove(csv_path);
+	remove(input_path);
+	remove(output_path);
+
+	std::cout << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+
+// a stream of requests from a few hundred distinct formulas, evaluated on the
+// submitting thread against handing them to the pipeline
+void bench_async(const eval::evaluator_t& evaluate)
+{
+	const size_t requests = 1 << 18;
+
+	std::vector<std::string> expressions;
+	for (size_t i = 0; i < 500; i++)
+		expressions.push_back("sqrt(" + std::to_string(i) + ") * 2 + pow(1.5, " + std::to_string(i % 7) + ") - |pi - " + std::to_string(i) + "|");
+
+	std::cout << "async, " << requests << " requests" << std::endl;
+	std::cout << "  submitting thread ms   total ms   cache hits   most queued" << std::endl;
+
+	double sum = 0;
+	const double sync_ms = time_ms([&] {
+		for (size_t i = 0; i < requests; i++)
+			sum += evaluate(expressions[i * 7919 % expressions.size()]);
+	});
+	printf("  %20.1f %10.1f %12s %13s   synchronous\n", sync_ms, sync_ms, "-", "-");
+
+	std::atomic<size_t> delivered(0);
+	size_t most_queued = 0;
+	double submit_ms;
+	eval::async_stats_t stats;
+
+	const double total_ms = time_ms([&] {
+		eval::async_evaluator_t async(evaluate);
+
+		submit_ms = time_ms([&] {
+			for (size_t i = 0; i < requests; i++)
+			{
+				async.submit(expressions[i * 7919 % expressions.size()], [&](double, std::exception_ptr) { delivered++; });
+
+				if (i % 1024 == 0)
+				{
+					const eval::async_stats_t now = async.stats();
+					most_queued = std::max(most_queued, now.m_parse_queue_depth + now.m_evaluate_queue_depth + now.m_deliver_queue_depth);
+				}
+			}
+		});
+
+		// the destructor waits for everything to be delivered
+		stats = async.stats();
+	});
+
+	printf("  %20.1f %10.1f %12llu %13llu   pipelined\n", submit_ms, total_ms,
+		static_cast<unsigned long long>(stats.m_cache_hits), static_cast<unsigned long long>(most_queued));
+
+	std::cout << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+
+// stands in for an expensive user function, e.g. interpolating a big table
+double slow_series(const double* args)
+{
+	double sum = 0;
+	for (int i = 1; i <= 200; i++)
+		sum += std::sin(args[0] * i) / i;
+	return sum;
+}
+
+void bench_parallel(eval::evaluator_t evaluate)
+{
+	evaluate.add_function(eval::function_info_t("series", 1, slow_series));
+
+	eval::task_pool_t pool;
+
+	std::cout << "parallel, " << pool.thread_count() << " threads" << std::endl;
+	std::cout << "       terms   serial ms   parallel ms   identical" << std::endl;
+
+	const double x = 0.75;
+
+	for (size_t terms = 1000; terms <= 100000; terms *= 10)
+	{
+		std::string expression = "0";
+		for (size_t i = 0; i < terms; i++)
+			expression += " + series(x*" + std::to_string(i % 100 + 1) + ")*pow(x, 2) - exp(-x)";
+
+		const eval::program_t program = evaluate.compile(expression);
+
+		double serial = 0, parallel = 0;
+
+		evaluate.set_parallelism(nullptr, 0);
+		const double serial_ms = time_ms([&] { serial = evaluate.evaluate(program, &x); });
+
+		evaluate.set_parallelism(&pool, 10000);
+		const double parallel_ms = time_ms([&] { parallel = evaluate.evaluate(program, &x); });
+
+		printf("%12llu %11.2f %13.2f %11s\n", (unsigned long long)terms, serial_ms, parallel_ms,
+			std::memcmp(&serial, &parallel, sizeof(double)) == 0 ? "yes" : "no");
+	}
+
+	std::cout << std::endl;
+}
+
+}
+
+// -----------------------------------------------------------------------------
+
+int main(int argc, char const* argv[])
+{
+	const eval::evaluator_t evaluate = make_evaluator();
+
+	bench_scaling(evaluate);
+	bench_dispatch(evaluate);
+	bench_lexer(evaluate);
+	bench_precision(evaluate);
+	bench_select(evaluate);
+	bench_columns(evaluate);
+	bench_async(evaluate);
+	bench_parallel(evaluate);
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "eval/evaluator.h"
+
+namespace eval
+{
+
+struct async_options_t
+{
+	// how many requests each queue between stages holds, rounded up to a power of
+	// two, once the submission queue is full submit waits and try_submit fails
+	size_t m_queue_capacity = 1024;
+
+	// the most requests a stage takes off its queue at once
+	size_t m_batch_size = 64;
+
+	// compiled programs kept, keyed on the expression, 0 turns the cache off
+	size_t m_cache_size = 4096;
+
+	size_t m_evaluate_threads = 1;
+};
+
+struct async_stats_t
+{
+	size_t m_submitted;
+	size_t m_rejected; // try_submit found the queue full
+	size_t m_completed;
+	size_t m_cache_hits;
+	size_t m_cache_misses;
+
+	// requests waiting in front of each stage, at the time of the call
+	size_t m_parse_queue_depth;
+	size_t m_evaluate_queue_depth;
+	size_t m_deliver_queue_depth;
+};
+
+// evaluates expressions off the calling thread, as a pipeline of stages, each
+// on its own thread(s), joined by bounded lock free queues
+//
+//   submit -> parse (with a cache of programs) -> evaluate -> deliver
+//
+// the evaluator is copied, so changing the original afterwards has no effect,
+// results are delivered on the delivery thread, so callbacks shouldn't hold it
+// up for long (anything they throw is dropped), and requests aren't necessarily
+// completed in the order given
+struct async_evaluator_t
+{
+	// error is null on success, otherwise it holds the parse_exception or
+	// evaluation_exception that would have been thrown
+	typedef std::function<void(double result, std::exception_ptr error)> callback_t;
+
+	explicit async_evaluator_t(const evaluator_t& evaluator, const async_options_t& options = async_options_t());
+
+	// finishes everything already submitted before returning
+	~async_evaluator_t();
+
+	async_evaluator_t(const async_evaluator_t&) = delete;
+	async_evaluator_t& operator=(const async_evaluator_t&) = delete;
+
+	// waits for space if the submission queue is full
+	std::future<double> submit(const std::string& expression);
+	void submit(const std::string& expression, callback_t callback);
+
+	// never waits, returns false if the submission queue is full
+	bool try_submit(const std::string& expression, std::future<double>& result);
+	bool try_submit(const std::string& expression, callback_t callback);
+
+	async_stats_t stats() const;
+
+private:
+
+	struct request_t;
+	struct queue_t;
+	struct program_cache_t;
+
+	bool push_request(std::unique_ptr<request_t>& request, bool wait);
+
+	void parse_stage();
+	void evaluate_stage();
+	void deliver_stage();
+
+	const evaluator_t m_evaluator;
+	const async_options_t m_options;
+
+	std::unique_ptr<queue_t> m_parse_queue;
+	std::unique_ptr<queue_t> m_evaluate_queue;
+	std::unique_ptr<queue_t> m_deliver_queue;
+	std::unique_ptr<program_cache_t> m_cache;
+
+	// each stage finishes once the one before it has and its queue is empty
+	std::atomic<bool> m_stopping;
+	std::atomic<bool> m_parse_done;
+	std::atomic<size_t> m_evaluate_running;
+
+	std::atomic<size_t> m_submitted;
+	std::atomic<size_t> m_rejected;
+	std::atomic<size_t> m_completed;
+	std::atomic<size_t> m_cache_hits;
+	std::atomic<size_t> m_cache_misses;
+
+	std::vector<std::thread> m_threads;
+};
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "eval/evaluator.h"
+
+namespace eval
+{
+
+// a column file is a header followed by one contiguous array per column, all
+// little endian, so the arrays can be used straight from the mapped pages
+//
+//   char magic[8]             "EVALCOL1"
+//   uint64 rows
+//   uint64 column count
+//   then per column, 64 bytes:
+//     char name[48]           null padded
+//     uint32 type             column_type_t
+//     uint32 reserved         0
+//     uint64 offset           from the start of the file, aligned to the type
+//
+// write_column_file and evaluate_column_file put each array on a 64 byte boundary
+
+enum class column_type_t : std::uint32_t { f64 = 1, f32 = 2 };
+
+struct mapped_file_t;
+
+// a column file mapped read only, the file stays mapped for as long as this lives
+struct column_file_t
+{
+	explicit column_file_t(const std::string& path);
+	~column_file_t();
+
+	column_file_t(const column_file_t&) = delete;
+	column_file_t& operator=(const column_file_t&) = delete;
+
+	size_t rows() const;
+	size_t column_count() const;
+
+	// returns column_count() if there isn't a column with that name
+	size_t find_column(const std::string& name) const;
+
+	const std::string& column_name(size_t column) const;
+	column_type_t column_type(size_t column) const;
+
+	// points into the mapping, cast to double or float depending on the type
+	const void* column_data(size_t column) const;
+
+private:
+
+	std::unique_ptr<mapped_file_t> m_mapping;
+
+	size_t m_rows;
+	std::vector<std::string> m_names;
+	std::vector<column_type_t> m_types;
+	std::vector<const void*> m_data;
+};
+
+// writes f64 columns, columns[i][r] is row r of the column called names[i]
+void write_column_file(const std::string& path, size_t rows, const std::vector<std::string>& names, const double* const* columns);
+
+// evaluates each program over every row of the input file, reading variables
+// from the columns with matching names, and writes one f64 column per program
+// to the output file, under the name it's paired with
+//
+// rows are evaluated block_rows at a time, straight from the mapped input into
+// the mapped output, f32 columns are widened a block at a time, rows which fail
+// a validator are given NaN, columns that don't match a variable are ignored,
+// and a block_rows of 0 throws column_file_exception
+void evaluate_column_file(const evaluator_t& evaluator, const std::string& input_path,
+	const std::vector<std::pair<std::string, program_t>>& programs, const std::string& output_path,
+	size_t block_rows = 1 << 16);
+
+// -----------------------------------------------------------------------------
+
+struct column_file_exception : public std::exception
+{
+	column_file_exception(const std::string& error_message);
+
+	const char* what () const throw ();
+
+private:
+	const std::string m_error_message;
+};
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace eval
+{
+
+// a fixed set of worker threads which can be shared between evaluators
+struct task_pool_t
+{
+	explicit task_pool_t(size_t thread_count = std::thread::hardware_concurrency());
+	~task_pool_t();
+
+	task_pool_t(const task_pool_t&) = delete;
+	task_pool_t& operator=(const task_pool_t&) = delete;
+
+	// calls task(0) to task(count - 1) across the pool and returns once they've
+	// all finished, the calling thread takes tasks too, so it's fine to call run
+	// from inside a task
+	void run(size_t count, const std::function<void(size_t)>& task);
+
+	size_t thread_count() const;
+
+private:
+
+	struct job_t;
+
+	void worker();
+
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::deque<std::shared_ptr<job_t>> m_jobs;
+	bool m_stopping;
+};
+
+}
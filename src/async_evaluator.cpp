@@ -0,0 +1,564 @@
+#include "eval/async_evaluator.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+namespace eval
+{
+
+// -----------------------------------------------------------------------------
+
+struct async_evaluator_t::request_t
+{
+	std::string m_expression;
+
+	// exactly one of these is used, whichever way it was submitted
+	std::promise<double> m_promise;
+	callback_t m_callback;
+
+	std::shared_ptr<const program_t> m_program;
+	double m_result;
+	std::exception_ptr m_error;
+};
+
+// -----------------------------------------------------------------------------
+
+// BOUNDED QUEUE
+
+// a fixed ring of cells, each with a sequence number saying whose turn it is,
+// so producers and consumers only ever contend on a single compare and swap
+// (Dmitry Vyukov's bounded queue), any number of threads can push and pop
+//
+// a thread that's run out of things to do can block until the queue changes,
+// pushing and popping only touch the lock when someone's actually waiting
+struct async_evaluator_t::queue_t
+{
+	explicit queue_t(const size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+
+		m_cells = std::vector<cell_t>(size);
+		m_mask = size - 1;
+
+		for (size_t i = 0; i < size; i++)
+			m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+
+		m_push_position.store(0, std::memory_order_relaxed);
+		m_pop_position.store(0, std::memory_order_relaxed);
+		m_pop_waiters.store(0, std::memory_order_relaxed);
+		m_push_waiters.store(0, std::memory_order_relaxed);
+	}
+
+	bool push(request_t* const request)
+	{
+		size_t position = m_push_position.load(std::memory_order_relaxed);
+
+		for (;;)
+		{
+			cell_t& cell = m_cells[position & m_mask];
+			const size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+			const std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+
+			if (difference == 0)
+			{
+				if (m_push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell.m_request = request;
+					cell.m_sequence.store(position + 1, std::memory_order_release);
+					notify(m_pop_waiters, m_pushed);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				// the cell still holds a request from the last time round, so it's full
+				return false;
+			}
+			else
+			{
+				position = m_push_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	request_t* pop()
+	{
+		size_t position = m_pop_position.load(std::memory_order_relaxed);
+
+		for (;;)
+		{
+			cell_t& cell = m_cells[position & m_mask];
+			const size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+			const std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+
+			if (difference == 0)
+			{
+				if (m_pop_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					request_t* const request = cell.m_request;
+					cell.m_sequence.store(position + m_mask + 1, std::memory_order_release);
+					notify(m_push_waiters, m_popped);
+					return request;
+				}
+			}
+			else if (difference < 0)
+			{
+				return nullptr;
+			}
+			else
+			{
+				position = m_pop_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// only a snapshot, it can be out of date by the time it's returned
+	size_t depth() const
+	{
+		const size_t popped = m_pop_position.load(std::memory_order_relaxed);
+		const size_t pushed = m_push_position.load(std::memory_order_relaxed);
+		return pushed > popped ? pushed - popped : 0;
+	}
+
+	// blocks until there might be something to pop, or done() is true
+	template <typename Done>
+	void wait_for_push(const Done& done)
+	{
+		wait(m_pop_waiters, m_pushed, [&] { return depth() != 0 || done(); });
+	}
+
+	// blocks until there might be room to push
+	void wait_for_pop()
+	{
+		wait(m_push_waiters, m_popped, [&] { return depth() <= m_mask; });
+	}
+
+	// for when whatever done() checks has changed
+	void wake()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pushed.notify_all();
+		m_popped.notify_all();
+	}
+
+private:
+
+	// the waiter count is raised before ready() is checked, and read after the
+	// queue changes, with a full fence between each pair, so either the waiter
+	// sees the change or the other side sees the waiter and takes the lock
+	template <typename Ready>
+	void wait(std::atomic<size_t>& waiters, std::condition_variable& condition, const Ready& ready)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		waiters.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (!ready())
+			condition.wait(lock);
+
+		waiters.fetch_sub(1);
+	}
+
+	void notify(const std::atomic<size_t>& waiters, std::condition_variable& condition)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) != 0)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			condition.notify_one();
+		}
+	}
+
+	struct cell_t
+	{
+		std::atomic<size_t> m_sequence;
+		request_t* m_request;
+	};
+
+	std::vector<cell_t> m_cells;
+	size_t m_mask;
+
+	// kept apart, so pushing and popping don't fight over a cache line
+	std::atomic<size_t> m_push_position;
+	char m_padding[64];
+	std::atomic<size_t> m_pop_position;
+
+	std::mutex m_mutex;
+	std::condition_variable m_pushed;
+	std::condition_variable m_popped;
+	std::atomic<size_t> m_pop_waiters;
+	std::atomic<size_t> m_push_waiters;
+};
+
+namespace
+{
+// for a thread with nothing to do, spins briefly, then yields, then says it's
+// time to block on the queue, so a busy pipeline never waits long and an idle
+// one doesn't burn a core
+struct backoff_t
+{
+	backoff_t() : m_count(0) {}
+
+	// returns false once it's time to block
+	bool spin()
+	{
+		if (m_count == 128)
+			return false;
+
+		if (++m_count > 64)
+			std::this_thread::yield();
+		return true;
+	}
+
+	void reset() { m_count = 0; }
+
+	unsigned m_count;
+};
+}
+
+// -----------------------------------------------------------------------------
+
+// PROGRAM CACHE
+
+// direct mapped on the hash of the expression, same as the function cache, only
+// the parse stage touches it so it needs no lock, the programs are shared so a
+// request keeps its own even if the slot's reused
+struct async_evaluator_t::program_cache_t
+{
+	explicit program_cache_t(const size_t size)
+		: m_expressions(size), m_programs(size)
+	{
+	}
+
+	std::shared_ptr<const program_t>* find(const std::string& expression)
+	{
+		const size_t slot = std::hash<std::string>()(expression) % m_programs.size();
+		return m_programs[slot] != nullptr && m_expressions[slot] == expression ? &m_programs[slot] : nullptr;
+	}
+
+	void insert(const std::string& expression, const std::shared_ptr<const program_t>& program)
+	{
+		const size_t slot = std::hash<std::string>()(expression) % m_programs.size();
+		m_expressions[slot] = expression;
+		m_programs[slot] = program;
+	}
+
+	std::vector<std::string> m_expressions;
+	std::vector<std::shared_ptr<const program_t>> m_programs;
+};
+
+// -----------------------------------------------------------------------------
+
+async_evaluator_t::async_evaluator_t(const evaluator_t& evaluator, const async_options_t& options)
+	: m_evaluator(evaluator), m_options(options)
+	, m_parse_queue(std::make_unique<queue_t>(options.m_queue_capacity))
+	, m_evaluate_queue(std::make_unique<queue_t>(options.m_queue_capacity))
+	, m_deliver_queue(std::make_unique<queue_t>(options.m_queue_capacity))
+	, m_cache(options.m_cache_size == 0 ? nullptr : std::make_unique<program_cache_t>(options.m_cache_size))
+	, m_stopping(false), m_parse_done(false), m_evaluate_running(std::max<size_t>(options.m_evaluate_threads, 1))
+	, m_submitted(0), m_rejected(0), m_completed(0), m_cache_hits(0), m_cache_misses(0)
+{
+	m_threads.emplace_back(&async_evaluator_t::parse_stage, this);
+	for (size_t i = 0; i < m_evaluate_running; i++)
+		m_threads.emplace_back(&async_evaluator_t::evaluate_stage, this);
+	m_threads.emplace_back(&async_evaluator_t::deliver_stage, this);
+}
+
+async_evaluator_t::~async_evaluator_t()
+{
+	m_stopping = true;
+	m_parse_queue->wake();
+
+	for (std::thread& thread : m_threads)
+		thread.join();
+}
+
+// -----------------------------------------------------------------------------
+
+std::future<double> async_evaluator_t::submit(const std::string& expression)
+{
+	auto request = std::make_unique<request_t>();
+	request->m_expression = expression;
+	std::future<double> result = request->m_promise.get_future();
+
+	push_request(request, true);
+	return result;
+}
+
+void async_evaluator_t::submit(const std::string& expression, callback_t callback)
+{
+	auto request = std::make_unique<request_t>();
+	request->m_expression = expression;
+	request->m_callback = std::move(callback);
+
+	push_request(request, true);
+}
+
+bool async_evaluator_t::try_submit(const std::string& expression, std::future<double>& result)
+{
+	auto request = std::make_unique<request_t>();
+	request->m_expression = expression;
+	std::future<double> future = request->m_promise.get_future();
+
+	if (!push_request(request, false))
+		return false;
+
+	result = std::move(future);
+	return true;
+}
+
+bool async_evaluator_t::try_submit(const std::string& expression, callback_t callback)
+{
+	auto request = std::make_unique<request_t>();
+	request->m_expression = expression;
+	request->m_callback = std::move(callback);
+
+	return push_request(request, false);
+}
+
+// the queue owns the request once it's been pushed
+bool async_evaluator_t::push_request(std::unique_ptr<request_t>& request, const bool wait)
+{
+	backoff_t backoff;
+	while (!m_parse_queue->push(request.get()))
+	{
+		if (!wait)
+		{
+			m_rejected++;
+			return false;
+		}
+
+		if (!backoff.spin())
+			m_parse_queue->wait_for_pop();
+	}
+
+	request.release();
+	m_submitted++;
+	return true;
+}
+
+async_stats_t async_evaluator_t::stats() const
+{
+	async_stats_t stats;
+	stats.m_submitted = m_submitted;
+	stats.m_rejected = m_rejected;
+	stats.m_completed = m_completed;
+	stats.m_cache_hits = m_cache_hits;
+	stats.m_cache_misses = m_cache_misses;
+	stats.m_parse_queue_depth = m_parse_queue->depth();
+	stats.m_evaluate_queue_depth = m_evaluate_queue->depth();
+	stats.m_deliver_queue_depth = m_deliver_queue->depth();
+	return stats;
+}
+
+// -----------------------------------------------------------------------------
+
+// STAGES
+
+namespace
+{
+// pushes to the next stage, waiting for space, which is what passes back
+// pressure up the pipeline
+template <typename Queue, typename Request>
+void forward(Queue& queue, Request* const request)
+{
+	backoff_t backoff;
+	while (!queue.push(request))
+	{
+		if (!backoff.spin())
+			queue.wait_for_pop();
+	}
+}
+}
+
+void async_evaluator_t::parse_stage()
+{
+	const size_t batch_size = std::max<size_t>(m_options.m_batch_size, 1);
+
+	backoff_t backoff;
+	std::vector<request_t*> batch;
+
+	for (;;)
+	{
+		// checked before popping, so nothing pushed before stopping is missed
+		const bool stopping = m_stopping;
+
+		batch.clear();
+		while (batch.size() < batch_size)
+		{
+			request_t* const request = m_parse_queue->pop();
+			if (request == nullptr)
+				break;
+			batch.push_back(request);
+		}
+
+		if (batch.empty())
+		{
+			if (stopping)
+				break;
+
+			if (!backoff.spin())
+				m_parse_queue->wait_for_push([this] { return m_stopping.load(); });
+			continue;
+		}
+
+		backoff.reset();
+
+		for (request_t* const request : batch)
+		{
+			try
+			{
+				std::shared_ptr<const program_t>* const cached = m_cache != nullptr ? m_cache->find(request->m_expression) : nullptr;
+
+				if (cached != nullptr)
+				{
+					m_cache_hits++;
+					request->m_program = *cached;
+				}
+				else
+				{
+					m_cache_misses++;
+					request->m_program = std::make_shared<const program_t>(m_evaluator.compile(request->m_expression));
+
+					if (m_cache != nullptr)
+						m_cache->insert(request->m_expression, request->m_program);
+				}
+			}
+			catch (...)
+			{
+				request->m_error = std::current_exception();
+			}
+
+			// failures skip evaluation and go straight to delivery
+			forward(request->m_error ? *m_deliver_queue : *m_evaluate_queue, request);
+		}
+	}
+
+	m_parse_done = true;
+	m_evaluate_queue->wake();
+	m_deliver_queue->wake();
+}
+
+void async_evaluator_t::evaluate_stage()
+{
+	const size_t batch_size = std::max<size_t>(m_options.m_batch_size, 1);
+
+	backoff_t backoff;
+	std::vector<request_t*> batch;
+
+	for (;;)
+	{
+		const bool parse_done = m_parse_done;
+
+		batch.clear();
+		while (batch.size() < batch_size)
+		{
+			request_t* const request = m_evaluate_queue->pop();
+			if (request == nullptr)
+				break;
+			batch.push_back(request);
+		}
+
+		if (batch.empty())
+		{
+			if (parse_done)
+				break;
+
+			if (!backoff.spin())
+				m_evaluate_queue->wait_for_push([this] { return m_parse_done.load(); });
+			continue;
+		}
+
+		backoff.reset();
+
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			request_t* const request = batch[i];
+
+			// the same expression submitted several times in a row shares a
+			// program, and has no variables, so if every function it calls is
+			// pure it only needs evaluating once
+			if (i > 0 && batch[i - 1]->m_program == request->m_program && m_evaluator.is_pure(*request->m_program))
+			{
+				request->m_result = batch[i - 1]->m_result;
+				request->m_error = batch[i - 1]->m_error;
+			}
+			else
+			{
+				try
+				{
+					request->m_result = m_evaluator.evaluate(*request->m_program);
+				}
+				catch (...)
+				{
+					request->m_error = std::current_exception();
+				}
+			}
+		}
+
+		for (request_t* const request : batch)
+			forward(*m_deliver_queue, request);
+	}
+
+	if (--m_evaluate_running == 0)
+		m_deliver_queue->wake();
+}
+
+void async_evaluator_t::deliver_stage()
+{
+	const size_t batch_size = std::max<size_t>(m_options.m_batch_size, 1);
+
+	backoff_t backoff;
+
+	for (;;)
+	{
+		// parse failures come straight here, so parsing has to be done too
+		const bool upstream_done = m_parse_done && m_evaluate_running == 0;
+
+		size_t delivered = 0;
+		for (request_t* request; delivered < batch_size && (request = m_deliver_queue->pop()) != nullptr; delivered++)
+		{
+			const std::unique_ptr<request_t> owned(request);
+
+			if (request->m_callback)
+			{
+				// there's nowhere to send an exception from a callback, and it
+				// mustn't stop everyone else's results being delivered
+				try
+				{
+					request->m_callback(request->m_result, request->m_error);
+				}
+				catch (...)
+				{
+				}
+			}
+			else if (request->m_error)
+			{
+				request->m_promise.set_exception(request->m_error);
+			}
+			else
+			{
+				request->m_promise.set_value(request->m_result);
+			}
+
+			m_completed++;
+		}
+
+		if (delivered == 0)
+		{
+			if (upstream_done)
+				break;
+
+			if (!backoff.spin())
+				m_deliver_queue->wait_for_push([this] { return m_parse_done && m_evaluate_running == 0; });
+			continue;
+		}
+
+		backoff.reset();
+	}
+}
+
+}
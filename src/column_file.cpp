@@ -0,0 +1,383 @@
+#include "eval/column_file.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace eval
+{
+
+// -----------------------------------------------------------------------------
+
+// MAPPED FILES
+
+// a whole file mapped into memory, either an existing one read only, or a new
+// one of a given size read and write
+struct mapped_file_t
+{
+	explicit mapped_file_t(const std::string& path)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			throw column_file_exception("couldn't open " + path);
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(m_file);
+			throw column_file_exception("couldn't map " + path + ", it's empty");
+		}
+		m_size = static_cast<size_t>(size.QuadPart);
+
+		map(path, PAGE_READONLY, FILE_MAP_READ);
+#else
+		const int file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			throw column_file_exception("couldn't open " + path);
+
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0)
+		{
+			close(file);
+			throw column_file_exception("couldn't map " + path + ", it's empty");
+		}
+		m_size = static_cast<size_t>(info.st_size);
+
+		map(path, file, PROT_READ);
+
+		// it's read front to back, once
+		madvise(m_data, m_size, MADV_SEQUENTIAL);
+#endif
+	}
+
+	mapped_file_t(const std::string& path, const size_t size)
+		: m_size(size)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			throw column_file_exception("couldn't create " + path);
+
+		// mapping more than the file holds grows it
+		map(path, PAGE_READWRITE, FILE_MAP_WRITE);
+#else
+		const int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (file < 0)
+			throw column_file_exception("couldn't create " + path);
+
+		if (ftruncate(file, static_cast<off_t>(size)) != 0)
+		{
+			close(file);
+			throw column_file_exception("couldn't grow " + path);
+		}
+
+		map(path, file, PROT_READ | PROT_WRITE);
+#endif
+	}
+
+	~mapped_file_t()
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+		CloseHandle(m_mapping);
+		CloseHandle(m_file);
+#else
+		munmap(m_data, m_size);
+#endif
+	}
+
+	mapped_file_t(const mapped_file_t&) = delete;
+	mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+	unsigned char* m_data;
+	size_t m_size;
+
+private:
+
+#ifdef _WIN32
+	void map(const std::string& path, const DWORD protection, const DWORD access)
+	{
+		const std::uint64_t size = m_size;
+		m_mapping = CreateFileMappingA(m_file, nullptr, protection, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+		m_data = m_mapping == nullptr ? nullptr : static_cast<unsigned char*>(MapViewOfFile(m_mapping, access, 0, 0, m_size));
+
+		if (m_data == nullptr)
+		{
+			if (m_mapping != nullptr)
+				CloseHandle(m_mapping);
+			CloseHandle(m_file);
+			throw column_file_exception("couldn't map " + path);
+		}
+	}
+
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	void map(const std::string& path, const int file, const int protection)
+	{
+		void* const data = mmap(nullptr, m_size, protection, MAP_SHARED, file, 0);
+
+		// the mapping holds its own reference to the file
+		close(file);
+
+		if (data == MAP_FAILED)
+			throw column_file_exception("couldn't map " + path);
+
+		m_data = static_cast<unsigned char*>(data);
+	}
+#endif
+};
+
+// -----------------------------------------------------------------------------
+
+// LAYOUT
+
+namespace
+{
+const char magic[8] = { 'E', 'V', 'A', 'L', 'C', 'O', 'L', '1' };
+
+const size_t header_size = 24;
+const size_t entry_size = 64;
+const size_t name_size = 48;
+const size_t alignment = 64;
+
+size_t align(const size_t offset)
+{
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+size_t type_size(const column_type_t type)
+{
+	return type == column_type_t::f32 ? sizeof(float) : sizeof(double);
+}
+
+template <typename T>
+T read(const unsigned char* data)
+{
+	T value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+template <typename T>
+void write(unsigned char* data, const T value)
+{
+	std::memcpy(data, &value, sizeof(value));
+}
+
+// lays out a file of f64 columns, the header followed by each column on a 64
+// byte boundary, returning the offset of each column
+std::vector<size_t> write_header(unsigned char* data, const size_t rows, const std::vector<std::string>& names)
+{
+	std::memcpy(data, magic, sizeof(magic));
+	write<std::uint64_t>(data + 8, rows);
+	write<std::uint64_t>(data + 16, names.size());
+
+	std::vector<size_t> offsets(names.size());
+
+	size_t offset = align(header_size + entry_size * names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (names[i].empty() || names[i].size() >= name_size)
+			throw column_file_exception("column names need 1 to 47 characters, not " + names[i]);
+
+		unsigned char* const entry = data + header_size + entry_size * i;
+		std::memset(entry, 0, entry_size);
+		std::memcpy(entry, names[i].data(), names[i].size());
+		write<std::uint32_t>(entry + name_size, static_cast<std::uint32_t>(column_type_t::f64));
+		write<std::uint64_t>(entry + name_size + 8, offset);
+
+		offsets[i] = offset;
+		offset += align(rows * sizeof(double));
+	}
+
+	return offsets;
+}
+
+size_t file_size(const size_t rows, const size_t columns)
+{
+	return align(header_size + entry_size * columns) + columns * align(rows * sizeof(double));
+}
+}
+
+// -----------------------------------------------------------------------------
+
+// COLUMN FILES
+
+column_file_t::column_file_t(const std::string& path)
+	: m_mapping(std::make_unique<mapped_file_t>(path))
+{
+	const unsigned char* const data = m_mapping->m_data;
+	const size_t size = m_mapping->m_size;
+
+	if (size < header_size || std::memcmp(data, magic, sizeof(magic)) != 0)
+		throw column_file_exception(path + " isn't a column file");
+
+	const std::uint64_t rows = read<std::uint64_t>(data + 8);
+	const std::uint64_t columns = read<std::uint64_t>(data + 16);
+
+	if (columns > (size - header_size) / entry_size)
+		throw column_file_exception(path + " is cut short, the header doesn't fit");
+
+	m_rows = static_cast<size_t>(rows);
+
+	for (size_t i = 0; i < columns; i++)
+	{
+		const unsigned char* const entry = data + header_size + entry_size * i;
+
+		const char* const name = reinterpret_cast<const char*>(entry);
+		const column_type_t type = static_cast<column_type_t>(read<std::uint32_t>(entry + name_size));
+		const std::uint64_t offset = read<std::uint64_t>(entry + name_size + 8);
+
+		m_names.emplace_back(name, std::find(name, name + name_size, '\0'));
+
+		if (type != column_type_t::f64 && type != column_type_t::f32)
+			throw column_file_exception("column " + m_names.back() + " has an unknown type");
+
+		// checked this way round so a huge row count can't overflow
+		const size_t element = type_size(type);
+		if (offset % element != 0 || offset > size || rows > (size - offset) / element)
+			throw column_file_exception("column " + m_names.back() + " doesn't fit in " + path);
+
+		m_types.push_back(type);
+		m_data.push_back(data + offset);
+	}
+}
+
+column_file_t::~column_file_t()
+{
+}
+
+size_t column_file_t::rows() const
+{
+	return m_rows;
+}
+
+size_t column_file_t::column_count() const
+{
+	return m_names.size();
+}
+
+size_t column_file_t::find_column(const std::string& name) const
+{
+	return std::find(m_names.begin(), m_names.end(), name) - m_names.begin();
+}
+
+const std::string& column_file_t::column_name(const size_t column) const
+{
+	return m_names[column];
+}
+
+column_type_t column_file_t::column_type(const size_t column) const
+{
+	return m_types[column];
+}
+
+const void* column_file_t::column_data(const size_t column) const
+{
+	return m_data[column];
+}
+
+// -----------------------------------------------------------------------------
+
+void write_column_file(const std::string& path, const size_t rows, const std::vector<std::string>& names, const double* const* columns)
+{
+	mapped_file_t file(path, file_size(rows, names.size()));
+
+	const std::vector<size_t> offsets = write_header(file.m_data, rows, names);
+	for (size_t i = 0; i < names.size(); i++)
+		std::memcpy(file.m_data + offsets[i], columns[i], rows * sizeof(double));
+}
+
+void evaluate_column_file(const evaluator_t& evaluator, const std::string& input_path,
+	const std::vector<std::pair<std::string, program_t>>& programs, const std::string& output_path, const size_t block_rows)
+{
+	if (block_rows == 0)
+		throw column_file_exception("block_rows needs to be at least 1");
+
+	const column_file_t input(input_path);
+	const size_t rows = input.rows();
+
+	// each variable reads straight from its column, unless it has to be widened
+	const std::vector<std::string>& variables = evaluator.variables();
+
+	std::vector<const double*> columns(variables.size(), nullptr);
+	std::vector<const float*> narrow_columns(variables.size(), nullptr);
+	std::vector<std::vector<double>> widened(variables.size());
+
+	for (size_t i = 0; i < variables.size(); i++)
+	{
+		const size_t column = input.find_column(variables[i]);
+		if (column == input.column_count())
+			throw column_file_exception("no column in " + input_path + " for variable " + variables[i]);
+
+		if (input.column_type(column) == column_type_t::f64)
+		{
+			columns[i] = static_cast<const double*>(input.column_data(column));
+		}
+		else
+		{
+			narrow_columns[i] = static_cast<const float*>(input.column_data(column));
+			widened[i].resize(std::min(block_rows, rows));
+		}
+	}
+
+	std::vector<std::string> names;
+	for (const auto& program : programs)
+		names.push_back(program.first);
+
+	mapped_file_t output(output_path, file_size(rows, programs.size()));
+	const std::vector<size_t> offsets = write_header(output.m_data, rows, names);
+
+	std::vector<const double*> block_columns(variables.size());
+	const auto valid = std::make_unique<bool[]>(std::min(block_rows, rows) + 1);
+
+	for (size_t begin = 0; begin < rows; begin += block_rows)
+	{
+		const size_t n = std::min(block_rows, rows - begin);
+
+		for (size_t i = 0; i < variables.size(); i++)
+		{
+			if (columns[i] != nullptr)
+			{
+				block_columns[i] = columns[i] + begin;
+			}
+			else
+			{
+				std::copy_n(narrow_columns[i] + begin, n, widened[i].begin());
+				block_columns[i] = widened[i].data();
+			}
+		}
+
+		for (size_t p = 0; p < programs.size(); p++)
+		{
+			double* const results = reinterpret_cast<double*>(output.m_data + offsets[p]) + begin;
+			evaluator.evaluate(programs[p].second, n, block_columns.data(), results, valid.get());
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+column_file_exception::column_file_exception(const std::string& error_message)
+	: m_error_message(error_message)
+{
+}
+
+const char* column_file_exception::what() const throw ()
+{
+	return m_error_message.c_str();
+}
+
+}
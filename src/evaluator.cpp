@@ -1,11 +1,25 @@
 #include "eval/evaluator.h"
+#include "eval/task_pool.h"
 
 #include <cmath>
 #include <iostream>
+#include <limits>
+#include <algorithm>
 #include <cctype>
+#include <cstring>
+#include <exception>
 #include <memory>
+#include <mutex>
 #include <stack>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EVAL_HAS_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 namespace eval
 {
 
@@ -33,12 +47,18 @@ double _add(const double a, const double b) { return a + b; }
 double _subtract(const double a, const double b) { return a - b; }
 double _multiply(const double a, const double b) { return a * b; }
 double _divide(const double a, const double b) { return a / b; }
+double _less(const double a, const double b) { return a < b; }
+double _greater(const double a, const double b) { return a > b; }
+double _equal(const double a, const double b) { return a == b; }
 }
 
 const operator_info_t add('+', 2, _add);
 const operator_info_t subtract('-', 2, _subtract);
 const operator_info_t multiply('*', 3, _multiply);
 const operator_info_t divide('/', 3, _divide, associativity_t::left, b_ne_zero);
+const operator_info_t less('<', 1, _less);
+const operator_info_t greater('>', 1, _greater);
+const operator_info_t equal('=', 1, _equal);
 }
 
 // -----------------------------------------------------------------------------
@@ -46,9 +66,18 @@ const operator_info_t divide('/', 3, _divide, associativity_t::left, b_ne_zero);
 // FUNCTIONS
 
 function_info_t::function_info_t(const std::string& name, const size_t param_count,
-	const function_info_t::function_t function, const function_info_t::validator_t validator)
+	const function_info_t::function_t function, const function_info_t::validator_t validator, const size_t cache_size)
 	: m_name(name), m_param_count(param_count)
 	, m_function(function), m_validator(validator)
+	, m_batch_function(nullptr), m_context(nullptr), m_cache_size(cache_size)
+{
+}
+
+function_info_t::function_info_t(const std::string& name, const size_t param_count,
+	const function_info_t::batch_function_t batch_function, void* const context, const size_t cache_size)
+	: m_name(name), m_param_count(param_count)
+	, m_function(nullptr), m_validator(nullptr)
+	, m_batch_function(batch_function), m_context(context), m_cache_size(cache_size)
 {
 }
 
@@ -68,6 +97,7 @@ double _exp(const double *args) { return std::exp(args[0]); }
 double _sqrt(const double *args) { return std::sqrt(args[0]); }
 double _pow(const double *args) { return std::pow(args[0], args[1]); }
 bool pow_validator(const double *args) { return args[1] >= 0 || fmod(args[1], 1.0) == 0; }
+double _select(const double *args) { return args[0] != 0 ? args[1] : args[2]; }
 }
 
 const function_info_t abs("abs", 1, _abs, always_valid);
@@ -75,6 +105,102 @@ const function_info_t sqrt("sqrt", 1, _sqrt, arg0_ge_zero);
 const function_info_t exp("exp", 1, _exp, always_valid);
 const function_info_t log("log", 1, _log, arg0_gt_zero);
 const function_info_t pow("pow", 2, _pow, pow_validator);
+const function_info_t select("select", 3, _select, always_valid);
+
+// -----------------------------------------------------------------------------
+
+// approximations for precision_t::fast, written without branches or library
+// calls so that the batch loops below can be vectorised
+
+namespace fast
+{
+
+namespace
+{
+const double ln2_hi = 6.93147180369123816490e-01; // upper bits of ln 2, so k * ln2_hi is exact
+const double ln2_lo = 1.90821492927058770002e-10;
+const double log2e = 1.44269504088896338700e+00;
+const double round_shift = 6755399441055744.0; // 1.5 * 2^52, adding it rounds to an integer
+const double two_52 = 4503599627370496.0;
+
+std::uint64_t to_bits(const double x)
+{
+	std::uint64_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	return bits;
+}
+
+double from_bits(const std::uint64_t bits)
+{
+	double x;
+	std::memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+// relative error below 3e-10 for x in [-708, 709], beyond that it gives 0 or inf
+double fast_exp(const double x)
+{
+	// e^x = 2^k * e^r, where k = round(x / ln 2), so |r| <= ln 2 / 2
+	const double clamped = std::min(std::max(x, -708.0), 709.0);
+	const double shifted = clamped * log2e + round_shift;
+	const double k = shifted - round_shift;
+	const double r = (clamped - k * ln2_hi) - k * ln2_lo;
+
+	// degree 8 taylor series for e^r
+	const double p = 1 + r * (1 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120
+		+ r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320))))))));
+
+	// k sits in the low bits of shifted, so 2^k can be built straight from them
+	const double scale = from_bits((to_bits(shifted) + 1023) << 52);
+	const double result = p * scale;
+
+	return x != x ? x : x > 709.0 ? std::numeric_limits<double>::infinity() : x < -708.0 ? 0.0 : result;
+}
+
+// absolute error below 1e-11 (and the same relative error for |log x| > 1), x > 0
+double fast_log(const double x)
+{
+	// subnormals are scaled up into the normal range first
+	const bool subnormal = x < std::numeric_limits<double>::min();
+	const double scaled = subnormal ? x * 18014398509481984.0 : x; // 2^54
+
+	// x = 2^e * m, with m in [sqrt(1/2), sqrt(2)), offsetting the bits by
+	// sqrt(1/2)'s mantissa first makes the exponent round to the nearest
+	const std::uint64_t sqrt_half_bits = 0x3FE6A09E667F3BCDull;
+	const std::uint64_t bits = to_bits(scaled) + (0x3FF0000000000000ull - sqrt_half_bits);
+	const double m = from_bits((bits & 0x000FFFFFFFFFFFFFull) + sqrt_half_bits);
+	const double e = (from_bits(0x4330000000000000ull | (bits >> 52)) - two_52) - (subnormal ? 1023 + 54 : 1023);
+
+	// log(m) = 2 atanh(f), |f| <= 0.1716, series to f^13
+	const double f = (m - 1) / (m + 1);
+	const double s = f * f;
+	const double log_m = 2 * f * (1 + s * (1.0 / 3 + s * (1.0 / 5 + s * (1.0 / 7 + s * (1.0 / 9 + s * (1.0 / 11 + s * (1.0 / 13)))))));
+
+	const double result = e * ln2_hi + (log_m + e * ln2_lo);
+
+	return x == std::numeric_limits<double>::infinity() ? x : result;
+}
+
+void batch_exp(void* context, const size_t rows, const size_t stride, const double* args, double* results, bool* valid)
+{
+	for (size_t r = 0; r < rows; r++)
+		results[r] = fast_exp(args[r]);
+}
+
+void batch_log(void* context, const size_t rows, const size_t stride, const double* args, double* results, bool* valid)
+{
+	for (size_t r = 0; r < rows; r++)
+	{
+		valid[r] = valid[r] && args[r] > 0;
+		results[r] = fast_log(args[r]);
+	}
+}
+}
+
+const function_info_t exp("exp", 1, batch_exp, nullptr);
+const function_info_t log("log", 1, batch_log, nullptr);
+
+}
 
 }
 
@@ -172,10 +298,19 @@ bool evaluator_t::read_token(const std::string& line, size_t& position, token_t&
 				position += identifier_length;
 				return true;
 			}
+
+			const auto variable_it = m_variable_name_map.find(identifier);
+			if (variable_it != m_variable_name_map.end())
+			{
+				token.m_type = token_type::VARIABLE;
+				token.m_id = variable_it->second;
+				position += identifier_length;
+				return true;
+			}
 		}
 
-		const auto unary_it = m_unary_map.find(line[position]);
-		if (unary_it != m_unary_map.end() && unary_it->second.m_associativity == associativity_t::right)
+		const auto unary_it = m_unary_symbol_map.find(line[position]);
+		if (unary_it != m_unary_symbol_map.end() && m_unaries[unary_it->second].m_associativity == associativity_t::right)
 		{
 			token.m_type = token_type::UNARY;
 			token.m_symbol = line[position++];
@@ -184,10 +319,12 @@ bool evaluator_t::read_token(const std::string& line, size_t& position, token_t&
 
 		if (isdigit(line[position]))
 		{
+			// strtod rather than sscanf, which measures the rest of the string
+			// first, making tokenising quadratic in the expression length
 			token.m_type = token_type::NUMBER;
-			int n;
-			sscanf_s(&line[position], "%lf%n", &token.m_value, &n);
-			position += n;
+			char* end;
+			token.m_value = strtod(line.c_str() + position, &end);
+			position = end - line.c_str();
 			return true;
 		}
 	}
@@ -207,15 +344,15 @@ bool evaluator_t::read_token(const std::string& line, size_t& position, token_t&
 			return true;
 		}
 
-		if (m_operator_map.find(line[position]) != m_operator_map.end())
+		if (m_operator_symbol_map.find(line[position]) != m_operator_symbol_map.end())
 		{
 			token.m_type = token_type::OPERATOR;
 			token.m_symbol = line[position++];
 			return true;
 		}
 
-		const auto unary_it = m_unary_map.find(line[position]);
-		if (unary_it != m_unary_map.end() && unary_it->second.m_associativity == associativity_t::left)
+		const auto unary_it = m_unary_symbol_map.find(line[position]);
+		if (unary_it != m_unary_symbol_map.end() && m_unaries[unary_it->second].m_associativity == associativity_t::left)
 		{
 			token.m_type = token_type::UNARY;
 			token.m_symbol = line[position++];
@@ -226,9 +363,304 @@ bool evaluator_t::read_token(const std::string& line, size_t& position, token_t&
 	return false;
 }
 
-std::list<token_t> evaluator_t::tokenise(const std::string& line) const
+// -----------------------------------------------------------------------------
+
+// SIMD LEXER
+
+namespace
+{
+
+#ifdef EVAL_HAS_SSE2
+size_t first_set_bit(const unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// all of these compare signed bytes, so anything outside ascii never matches,
+// the same as isspace/isalnum in the C locale
+__m128i in_range(const __m128i chars, const char low, const char high)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8(high + 1)));
+}
+
+__m128i space_mask(const __m128i chars)
+{
+	// ' ', or '\t' '\n' '\v' '\f' '\r'
+	return _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), in_range(chars, '\t', '\r'));
+}
+
+__m128i alnum_mask(const __m128i chars)
+{
+	const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+	return _mm_or_si128(in_range(chars, '0', '9'), in_range(lower, 'a', 'z'));
+}
+#endif
+
+// index of the first character from position on which isn't whitespace
+size_t skip_whitespace(const std::string& line, size_t position)
+{
+#ifdef EVAL_HAS_SSE2
+	for (; position + 16 <= line.size(); position += 16)
+	{
+		const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line.data() + position));
+		const unsigned others = ~_mm_movemask_epi8(space_mask(chars)) & 0xFFFF;
+		if (others != 0)
+			return position + first_set_bit(others);
+	}
+#endif
+
+	while (position < line.size() && isspace(line[position]))
+		position++;
+
+	return position;
+}
+
+// index of the first character from position on which isn't alphanumeric
+size_t skip_alnum(const std::string& line, size_t position)
+{
+#ifdef EVAL_HAS_SSE2
+	for (; position + 16 <= line.size(); position += 16)
+	{
+		const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line.data() + position));
+		const unsigned others = ~_mm_movemask_epi8(alnum_mask(chars)) & 0xFFFF;
+		if (others != 0)
+			return position + first_set_bit(others);
+	}
+#endif
+
+	while (position < line.size() && isalnum(line[position]))
+		position++;
+
+	return position;
+}
+
+// the same value strtod would give, but plain decimals like 42 or 1.5 are
+// worked out directly, a mantissa under 2^53 divided by a power of ten up to
+// 10^22 is exact over exact, so the one rounding is the same as strtod's,
+// anything else (exponents, hex, too many digits) is left to strtod
+size_t read_number(const std::string& line, size_t position, double& value)
+{
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	const char* const start = line.c_str() + position;
+	const char* p = start;
+
+	std::uint64_t mantissa = 0;
+	size_t digits = 0;
+	size_t fraction_digits = 0;
+
+	for (; isdigit(*p); p++, digits++)
+		mantissa = mantissa * 10 + (*p - '0');
+
+	if (*p == '.')
+	{
+		for (p++; isdigit(*p); p++, digits++, fraction_digits++)
+			mantissa = mantissa * 10 + (*p - '0');
+	}
+
+	// 15 digits always fit under 2^53, and the letters are exponents and hex
+	if (digits <= 15 && !isalpha(*p))
+	{
+		value = static_cast<double>(mantissa) / powers_of_ten[fraction_digits];
+		return position + (p - start);
+	}
+
+	char* end;
+	value = strtod(start, &end);
+	return end - line.c_str();
+}
+
+}
+
+// -----------------------------------------------------------------------------
+
+// IDENTIFIER TABLE
+
+namespace
+{
+// fnv-1a, identifiers are short so anything fancier wouldn't pay for itself
+size_t hash_identifier(const char* name, const size_t length)
+{
+	std::uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ull;
+	return static_cast<size_t>(hash);
+}
+
+int identifier_priority(const token_type type)
+{
+	return type == token_type::FUNCTION ? 2 : type == token_type::CONSTANT ? 1 : 0;
+}
+}
+
+void identifier_table_t::insert(const std::string& name, const token_type type, const size_t id)
+{
+	// kept at most half full, so probes stay short
+	if ((m_count + 1) * 2 > m_entries.size())
+	{
+		std::vector<entry_t> entries(std::max<size_t>(m_entries.size() * 2, 16));
+		std::swap(entries, m_entries);
+		m_count = 0;
+
+		for (entry_t& entry : entries)
+		{
+			if (!entry.m_name.empty())
+				insert(entry.m_name, entry.m_type, entry.m_id);
+		}
+	}
+
+	const size_t mask = m_entries.size() - 1;
+	for (size_t slot = hash_identifier(name.data(), name.size()) & mask;; slot = (slot + 1) & mask)
+	{
+		entry_t& entry = m_entries[slot];
+
+		if (entry.m_name.empty())
+		{
+			entry = { name, type, id };
+			m_count++;
+			return;
+		}
+
+		if (entry.m_name == name)
+		{
+			if (identifier_priority(type) > identifier_priority(entry.m_type))
+			{
+				entry.m_type = type;
+				entry.m_id = id;
+			}
+			return;
+		}
+	}
+}
+
+const identifier_table_t::entry_t* identifier_table_t::find(const char* name, const size_t length) const
+{
+	if (m_entries.empty())
+		return nullptr;
+
+	const size_t mask = m_entries.size() - 1;
+	for (size_t slot = hash_identifier(name, length) & mask;; slot = (slot + 1) & mask)
+	{
+		const entry_t& entry = m_entries[slot];
+
+		if (entry.m_name.empty())
+			return nullptr;
+
+		if (entry.m_name.size() == length && std::memcmp(entry.m_name.data(), name, length) == 0)
+			return &entry;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+// same tokens as read_token, but identifiers are scanned 16 characters at a
+// time and found in a single hash table, and symbols are classified with a
+// table rather than map lookups
+bool evaluator_t::read_token_simd(const std::string& line, size_t& position, token_t& token, const bool expecting_left_paren, const bool expecting_identifier) const
+{
+	const char c = line[position];
+	const unsigned char char_class = m_char_class[static_cast<unsigned char>(c)];
+
+	if (expecting_identifier)
+	{
+		if (c == '(' || c == '|')
+		{
+			token.m_type = token_type::LEFT_PAREN;
+			token.m_symbol = c;
+			position++;
+			return true;
+		}
+		else if (expecting_left_paren)
+		{
+			throw parse_exception("expecting left paren immediately after function token");
+		}
+
+		if (isalpha(c))
+		{
+			const size_t identifier_length = skip_alnum(line, position + 1) - position;
+
+			const identifier_table_t::entry_t* const entry = m_identifiers.find(line.data() + position, identifier_length);
+			if (entry != nullptr)
+			{
+				token.m_type = entry->m_type;
+				token.m_id = entry->m_id;
+				position += identifier_length;
+				return true;
+			}
+		}
+
+		if (char_class & char_class_right_unary)
+		{
+			token.m_type = token_type::UNARY;
+			token.m_symbol = c;
+			position++;
+			return true;
+		}
+
+		if (isdigit(c))
+		{
+			token.m_type = token_type::NUMBER;
+			position = read_number(line, position, token.m_value);
+			return true;
+		}
+	}
+	else
+	{
+		if (c == ')' || c == '|')
+		{
+			token.m_type = token_type::RIGHT_PAREN;
+			token.m_symbol = c;
+			position++;
+			return true;
+		}
+
+		if (c == ',')
+		{
+			token.m_type = token_type::COMMA;
+			token.m_symbol = c;
+			position++;
+			return true;
+		}
+
+		if (char_class & char_class_operator)
+		{
+			token.m_type = token_type::OPERATOR;
+			token.m_symbol = c;
+			position++;
+			return true;
+		}
+
+		if (char_class & char_class_left_unary)
+		{
+			token.m_type = token_type::UNARY;
+			token.m_symbol = c;
+			position++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// -----------------------------------------------------------------------------
+
+std::vector<token_t> evaluator_t::tokenise(const std::string& line) const
 {
-	std::list<token_t> output;
+	if (line.size() > m_max_length)
+		throw parse_exception(lazy_format("expression too long, %llu characters when the limit is %llu", line.size(), m_max_length));
+
+	// just a first guess, most tokens are followed by a space or an operator
+	std::vector<token_t> output;
+	output.reserve(line.size() / 2 + 1);
 
 	bool expecting_identifier = true;
 	bool expecting_left_paren = false;
@@ -237,12 +669,16 @@ std::list<token_t> evaluator_t::tokenise(const std::string& line) const
 	{
 		if (isspace(line[position]))
 		{
-			position++;
+			position = m_lexer == lexer_t::simd ? skip_whitespace(line, position + 1) : position + 1;
 			continue;
 		}
 
 		token_t token;
-		if (!read_token(line, position, token, expecting_left_paren, expecting_identifier))
+		const bool read = m_lexer == lexer_t::simd
+			? read_token_simd(line, position, token, expecting_left_paren, expecting_identifier)
+			: read_token(line, position, token, expecting_left_paren, expecting_identifier);
+
+		if (!read)
 			throw parse_exception(lazy_format("failed to read token at position %llu", position));
 
 		output.push_back(token);
@@ -258,11 +694,12 @@ std::list<token_t> evaluator_t::tokenise(const std::string& line) const
 			expecting_identifier = true;
 			break;
 		case token_type::UNARY:
-			expecting_identifier = m_unary_map.find(token.m_symbol)->second.m_associativity == associativity_t::right;
+			expecting_identifier = unary_info(token.m_symbol).m_associativity == associativity_t::right;
 			break;
 		case token_type::RIGHT_PAREN:
 		case token_type::NUMBER:
 		case token_type::CONSTANT:
+		case token_type::VARIABLE:
 		default:
 			expecting_identifier = false;
 			break;
@@ -303,6 +740,10 @@ void evaluator_t::print_tokens(const std::list<token_t>& tokens) const
 			std::cout << m_constants[token.m_id].m_name;
 			break;
 
+		case token_type::VARIABLE:
+			std::cout << m_variables[token.m_id];
+			break;
+
 		default:
 			std::cout << "[?]";
 			break;
@@ -314,22 +755,28 @@ void evaluator_t::print_tokens(const std::list<token_t>& tokens) const
 
 // -----------------------------------------------------------------------------
 
-std::list<token_t> evaluator_t::to_postfix(const std::list<token_t>& infix_tokens) const
+std::vector<token_t> evaluator_t::to_postfix(const std::vector<token_t>& infix_tokens) const
 {
-	std::stack<token_t> stack;
+	std::stack<token_t, std::vector<token_t>> stack;
 
 	// holds the number of arguments for the function currently being evaluated
 	// when we reach a "," we meed to treat that as an end-of-line, popping operators
-	std::stack<std::pair<char, size_t>> paren_stack;
+	std::stack<std::pair<char, size_t>, std::vector<std::pair<char, size_t>>> paren_stack;
 
-	std::list<token_t> postfix_tokens;
+	std::vector<token_t> postfix_tokens;
+	postfix_tokens.reserve(infix_tokens.size());
 
 	for (const auto& token : infix_tokens)
 	{
+		// the stack only grows with nesting, so this bounds the memory used
+		if (stack.size() > m_max_depth)
+			throw parse_exception(lazy_format("expression nested too deeply, limit is %llu", m_max_depth));
+
 		switch (token.m_type)
 		{
 		case token_type::NUMBER:
 		case token_type::CONSTANT:
+		case token_type::VARIABLE:
 			postfix_tokens.push_back(token);
 
 			while (!stack.empty() && stack.top().m_type == token_type::UNARY)
@@ -341,7 +788,7 @@ std::list<token_t> evaluator_t::to_postfix(const std::list<token_t>& infix_token
 			break;
 
 		case token_type::UNARY: {
-			const unary_info_t& info = m_unary_map.find(token.m_symbol)->second;
+			const unary_info_t& info = unary_info(token.m_symbol);
 			if (info.m_associativity == associativity_t::right)
 			{
 				stack.push(token);
@@ -357,11 +804,11 @@ std::list<token_t> evaluator_t::to_postfix(const std::list<token_t>& infix_token
 			break;
 		}
 		case token_type::OPERATOR: {
-			const auto& info = m_operator_map.find(token.m_symbol)->second;
-			decltype(m_operator_map.begin()) it;
+			const auto& info = operator_info(token.m_symbol);
+			const operator_info_t* top_info;
 			while (!stack.empty() && stack.top().m_type == token_type::OPERATOR &&
-				(it = m_operator_map.find(stack.top().m_symbol), it->second.m_precedence > info.m_precedence ||
-					(it->second.m_precedence == info.m_precedence && info.m_associativity == associativity_t::left)))
+				(top_info = &operator_info(stack.top().m_symbol), top_info->m_precedence > info.m_precedence ||
+					(top_info->m_precedence == info.m_precedence && info.m_associativity == associativity_t::left)))
 			{
 				postfix_tokens.push_back(stack.top());
 				stack.pop();
@@ -458,105 +905,1216 @@ std::list<token_t> evaluator_t::to_postfix(const std::list<token_t>& infix_token
 
 // -----------------------------------------------------------------------------
 
-double evaluator_t::evaluate(std::list<token_t> postfix_tokens) const
+// INSTRUCTIONS
+
+namespace
 {
-	auto get_token_value = [&](const token_t& token)
-		{
-			switch (token.m_type)
-			{
-			case token_type::NUMBER:
-				return token.m_value;
-			case token_type::CONSTANT:
-				return m_constants[token.m_id].m_value;
-			default:
-				// shouldn't happen, unless someone's been fiddling with the tokens...
-				throw evaluation_exception("trying to get value from non-const non-number token");
-			}
-		};
+const std::uint64_t box_prefix = 0xFFF8000000000000ull;
+const std::uint64_t canonical_nan = 0x7FF8000000000000ull;
+const int opcode_shift = 47;
+const std::uint64_t payload_mask = (1ull << opcode_shift) - 1;
+}
 
-	for (auto it = postfix_tokens.begin(); it != postfix_tokens.end(); ++it)
-	{
-		switch (it->m_type)
-		{
-		case token_type::UNARY:
-		{
-			const char op = it->m_symbol;
-			const auto& unary_info = m_unary_map.find(op)->second;
+instruction_t instruction_t::number(const double value)
+{
+	instruction_t instruction;
 
-			const double x = get_token_value(*(--it));
+	std::memcpy(&instruction.m_bits, &value, sizeof(value));
 
-			it = postfix_tokens.erase(it);
+	// a NaN that looks like a boxed instruction is collapsed to the positive
+	// quiet NaN, unless its opcode bits are NUMBER's, which decode back to the
+	// same bits, the default NaN of x86 (0xFFF8000000000000) being one of those
+	if ((instruction.m_bits & box_prefix) == box_prefix && ((instruction.m_bits >> opcode_shift) & 0xF) != static_cast<std::uint64_t>(opcode_t::NUMBER))
+		instruction.m_bits = canonical_nan;
 
-			if (!unary_info.m_validator(x))
-				throw evaluation_exception(lazy_format("unary validator failed (%c)", op));
+	return instruction;
+}
 
-			const double result = unary_info.m_operation(x);
+instruction_t instruction_t::boxed(const opcode_t opcode, const std::uint64_t payload)
+{
+	instruction_t instruction;
+	instruction.m_bits = box_prefix | (static_cast<std::uint64_t>(opcode) << opcode_shift) | (payload & payload_mask);
+	return instruction;
+}
 
-			it->m_type = token_type::NUMBER;
-			it->m_value = result;
-			break;
-		}
-		case token_type::OPERATOR:
-		{
-			const char op = it->m_symbol;
-			const auto& operator_info = m_operator_map.find(op)->second;
+opcode_t instruction_t::opcode() const
+{
+	if ((m_bits & box_prefix) != box_prefix)
+		return opcode_t::NUMBER;
 
-			const double b = get_token_value(*(--it));
-			const double a = get_token_value(*(--it));
+	return static_cast<opcode_t>((m_bits >> opcode_shift) & 0xF);
+}
 
-			it = postfix_tokens.erase(it);
-			it = postfix_tokens.erase(it);
+double instruction_t::value() const
+{
+	double value;
+	std::memcpy(&value, &m_bits, sizeof(value));
+	return value;
+}
 
-			if (!operator_info.m_validator(a, b))
-				throw evaluation_exception(lazy_format("operator validator failed (%c)", op));
+std::uint64_t instruction_t::payload() const
+{
+	return m_bits & payload_mask;
+}
 
-			const double result = operator_info.m_operation(a, b);
+// -----------------------------------------------------------------------------
 
-			it->m_type = token_type::NUMBER;
-			it->m_value = result;
-			break;
-		}
-		case token_type::FUNCTION:
-		{
-			const size_t function_id = it->m_id;
+template <typename Tokens>
+program_t evaluator_t::compile_postfix(const Tokens& postfix_tokens) const
+{
+	program_t program;
+	program.m_instructions.reserve(postfix_tokens.size());
+	program.m_stack_size = 0;
 
-			const auto& function_info = m_functions[function_id];
+	size_t depth = 0;
 
-			auto args = std::make_unique<double[]>(function_info.m_param_count);
+	// where the code for each value on the stack starts, so the branches of a
+	// select can be found once it's reached
+	std::vector<size_t> starts;
 
-			for (size_t i = function_info.m_param_count; i > 0;)
-				args[--i] = get_token_value(*(--it));
+	struct select_t
+	{
+		size_t m_a_start;
+		size_t m_b_start;
+		size_t m_select;
+	};
 
-			for (size_t i = 0; i < function_info.m_param_count; i++)
-				it = postfix_tokens.erase(it);
+	std::vector<select_t> selects;
 
-			if (!function_info.m_validator(args.get()))
-				throw evaluation_exception(lazy_format("function validator failed (%s)", function_info.m_name.c_str()));
+	auto pop = [&](const size_t count)
+		{
+			if (depth < count)
+				throw parse_exception("malformed postfix expression, not enough operands");
+			depth -= count;
+		};
 
-			const double result = function_info.m_function(args.get());
+	for (const token_t& token : postfix_tokens)
+	{
+		const size_t start = program.m_instructions.size();
+		const size_t depth_before = depth;
 
-			it->m_type = token_type::NUMBER;
-			it->m_value = result;
+		switch (token.m_type)
+		{
+		case token_type::NUMBER:
+			program.m_instructions.push_back(instruction_t::number(token.m_value));
 			break;
-		}
-		default:
+		case token_type::CONSTANT:
+			program.m_instructions.push_back(instruction_t::boxed(opcode_t::CONSTANT, token.m_id));
 			break;
-		}
-	}
-
-	return get_token_value(postfix_tokens.front());
-}
+		case token_type::VARIABLE:
+			program.m_instructions.push_back(instruction_t::boxed(opcode_t::VARIABLE, token.m_id));
+			break;
+		case token_type::OPERATOR:
+			pop(2);
+			program.m_instructions.push_back(instruction_t::boxed(opcode_t::OPERATOR, m_operator_symbol_map.find(token.m_symbol)->second));
+			break;
+		case token_type::UNARY:
+			pop(1);
+			program.m_instructions.push_back(instruction_t::boxed(opcode_t::UNARY, m_unary_symbol_map.find(token.m_symbol)->second));
+			break;
+		case token_type::FUNCTION:
+			pop(m_functions[token.m_id].m_param_count);
+			if (m_select_functions[token.m_id])
+			{
+				selects.push_back({ starts[depth + 1], starts[depth + 2], start });
+				program.m_instructions.push_back(instruction_t::boxed(opcode_t::SELECT, 0));
+			}
+			else
+			{
+				program.m_instructions.push_back(instruction_t::boxed(opcode_t::FUNCTION, token.m_id));
+			}
+			break;
+		default:
+			// shouldn't happen, unless someone's been fiddling with the tokens...
+			throw parse_exception("unexpected token in postfix expression");
+		}
+
+		// an operation's code starts where its first operand's does
+		starts.resize(depth + 1);
+		if (depth == depth_before)
+			starts[depth] = start;
+
+		if (++depth > program.m_stack_size)
+			program.m_stack_size = depth;
+
+		if (depth > m_max_depth)
+			throw parse_exception(lazy_format("expression nested too deeply, limit is %llu", m_max_depth));
+	}
+
+	if (depth != 1)
+		throw parse_exception("malformed postfix expression, expected a single result");
+
+	if (selects.empty())
+	{
+		program.m_cost = program_cost(program.m_instructions);
+		return program;
+	}
+
+	// each select needs a JUMP_IF_ZERO before its first branch and a JUMP before
+	// its second, no two of which can ever land in the same place, so a running
+	// count of how many go before each instruction says where it ends up
+	const size_t size = program.m_instructions.size();
+
+	std::vector<size_t> moved(size + 1, 0);
+	for (const select_t& select : selects)
+	{
+		moved[select.m_a_start] = 1;
+		moved[select.m_b_start] = 1;
+	}
+
+	for (size_t i = 0, count = 0; i <= size; i++)
+	{
+		count += moved[i];
+		moved[i] = i + count;
+	}
+
+	std::vector<instruction_t> instructions(size + 2 * selects.size());
+	for (size_t i = 0; i < size; i++)
+		instructions[moved[i]] = program.m_instructions[i];
+
+	for (const select_t& select : selects)
+	{
+		const size_t jump_if_zero = moved[select.m_a_start] - 1;
+		const size_t jump = moved[select.m_b_start] - 1;
+
+		instructions[jump_if_zero] = instruction_t::boxed(opcode_t::JUMP_IF_ZERO, jump + 1 - jump_if_zero);
+		instructions[jump] = instruction_t::boxed(opcode_t::JUMP, moved[select.m_select] + 1 - jump);
+	}
+
+	program.m_instructions = std::move(instructions);
+
+	program.m_cost = program_cost(program.m_instructions);
+	return program;
+}
+
+program_t evaluator_t::compile(const std::list<token_t>& postfix_tokens) const
+{
+	return compile_postfix(postfix_tokens);
+}
+
+program_t evaluator_t::compile(const std::string& expression) const
+{
+	return compile_postfix(to_postfix(tokenise(expression)));
+}
+
+// -----------------------------------------------------------------------------
+
+// FUNCTION CACHE
+
+// direct mapped, so it never grows and a lookup is a single probe, a newer
+// result simply replaces whichever one was in its slot
+struct function_cache_t
+{
+	function_cache_t(const size_t param_count, const size_t size)
+		: m_param_count(param_count), m_keys(param_count * size), m_results(size)
+		, m_occupied(size, false), m_hits(0), m_misses(0)
+	{
+	}
+
+	size_t slot(const double* args, const size_t stride) const
+	{
+		// doubles tend to differ only in their high bits, so each argument is
+		// mixed with the splitmix64 finaliser before it's combined
+		std::uint64_t hash = 0;
+		for (size_t i = 0; i < m_param_count; i++)
+		{
+			std::uint64_t bits;
+			std::memcpy(&bits, args + i * stride, sizeof(bits));
+			hash += bits + 0x9E3779B97F4A7C15ull;
+			hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+			hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+			hash ^= hash >> 31;
+		}
+		return static_cast<size_t>(hash % m_results.size());
+	}
+
+	bool find(const double* args, const size_t stride, double& result)
+	{
+		const size_t index = slot(args, stride);
+
+		if (m_occupied[index] && matches(index, args, stride))
+		{
+			m_hits++;
+			result = m_results[index];
+			return true;
+		}
+
+		m_misses++;
+		return false;
+	}
+
+	void insert(const double* args, const size_t stride, const double result)
+	{
+		const size_t index = slot(args, stride);
+
+		for (size_t i = 0; i < m_param_count; i++)
+			std::memcpy(&m_keys[index * m_param_count + i], args + i * stride, sizeof(double));
+
+		m_results[index] = result;
+		m_occupied[index] = true;
+	}
+
+	bool matches(const size_t index, const double* args, const size_t stride) const
+	{
+		for (size_t i = 0; i < m_param_count; i++)
+		{
+			std::uint64_t bits;
+			std::memcpy(&bits, args + i * stride, sizeof(bits));
+			if (m_keys[index * m_param_count + i] != bits)
+				return false;
+		}
+		return true;
+	}
+
+	std::mutex m_mutex;
+
+	const size_t m_param_count;
+	std::vector<std::uint64_t> m_keys;
+	std::vector<double> m_results;
+	std::vector<bool> m_occupied;
+
+	size_t m_hits;
+	size_t m_misses;
+};
+
+// -----------------------------------------------------------------------------
+
+void evaluator_t::call_uncached_function(const function_info_t& info, const size_t rows, const size_t stride,
+	const double* args, double* results, bool* valid) const
+{
+	if (info.m_function == nullptr)
+	{
+		info.m_batch_function(info.m_context, rows, stride, args, results, valid);
+		return;
+	}
+
+	// scalar functions are adapted by gathering each row's parameters
+	double row_args[16];
+	std::unique_ptr<double[]> heap_args;
+	double* row = row_args;
+
+	if (info.m_param_count > 16)
+	{
+		heap_args = std::make_unique<double[]>(info.m_param_count);
+		row = heap_args.get();
+	}
+
+	for (size_t r = 0; r < rows; r++)
+	{
+		if (!valid[r])
+			continue;
+
+		for (size_t i = 0; i < info.m_param_count; i++)
+			row[i] = args[i * stride + r];
+
+		if (info.m_validator(row))
+			results[r] = info.m_function(row);
+		else
+			valid[r] = false;
+	}
+}
+
+const function_info_t& evaluator_t::function_info(const size_t function_id) const
+{
+	if (m_precision == precision_t::fast && m_fast_functions[function_id] != nullptr)
+		return *m_fast_functions[function_id];
+
+	return m_functions[function_id];
+}
+
+// the cache only ever holds exact results, so it's passed over while an
+// approximation is standing in for the function
+function_cache_t* evaluator_t::function_cache(const size_t function_id) const
+{
+	if (m_precision == precision_t::fast && m_fast_functions[function_id] != nullptr)
+		return nullptr;
+
+	return m_function_caches[function_id].get();
+}
+
+void evaluator_t::call_function(const size_t function_id, const size_t rows, const size_t stride,
+	const double* args, double* results, bool* valid) const
+{
+	const function_info_t& info = function_info(function_id);
+	function_cache_t* const cache = function_cache(function_id);
+
+	if (cache == nullptr)
+	{
+		call_uncached_function(info, rows, stride, args, results, valid);
+		return;
+	}
+
+	// only the rows which missed the cache are passed on to the function
+	const auto hit = std::make_unique<bool[]>(rows);
+	const auto missed = std::make_unique<bool[]>(rows);
+
+	{
+		std::lock_guard<std::mutex> lock(cache->m_mutex);
+		for (size_t r = 0; r < rows; r++)
+		{
+			hit[r] = valid[r] && cache->find(args + r, stride, results[r]);
+			missed[r] = valid[r] && !hit[r];
+		}
+	}
+
+	call_uncached_function(info, rows, stride, args, results, missed.get());
+
+	// results are only remembered once they've passed validation
+	std::lock_guard<std::mutex> lock(cache->m_mutex);
+	for (size_t r = 0; r < rows; r++)
+	{
+		if (!valid[r] || hit[r])
+			continue;
+
+		if (missed[r])
+			cache->insert(args + r, stride, results[r]);
+		else
+			valid[r] = false;
+	}
+}
+
+double evaluator_t::call_function(const size_t function_id, const double* args) const
+{
+	const function_info_t& info = function_info(function_id);
+	function_cache_t* const cache = function_cache(function_id);
+
+	double result;
+
+	// a single row doesn't need the bookkeeping of the batch path, and the lock
+	// isn't held while the function runs
+	if (cache != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(cache->m_mutex);
+		if (cache->find(args, 1, result))
+			return result;
+	}
+
+	bool valid = true;
+	if (info.m_function != nullptr)
+	{
+		valid = info.m_validator(args);
+		if (valid)
+			result = info.m_function(args);
+	}
+	else
+	{
+		info.m_batch_function(info.m_context, 1, 1, args, &result, &valid);
+	}
+
+	if (!valid)
+		throw evaluation_exception("function validator failed (" + info.m_name + ")");
+
+	if (cache != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(cache->m_mutex);
+		cache->insert(args, 1, result);
+	}
+
+	return result;
+}
+
+double evaluator_t::evaluate(const program_t& program) const
+{
+	return evaluate(program, nullptr);
+}
+
+double evaluator_t::evaluate(const program_t& program, const double* variables) const
+{
+	if (m_task_pool != nullptr && program.m_cost > m_parallel_cost_threshold)
+		return evaluate_parallel(program, variables);
+
+	const instruction_t* const begin = program.m_instructions.data();
+	return evaluate_range(begin, begin + program.m_instructions.size(), program.m_stack_size, variables);
+}
+
+double evaluator_t::evaluate_range(const instruction_t* begin, const instruction_t* end, const size_t stack_size, const double* variables, const double* results) const
+{
+#ifdef EVAL_HAS_COMPUTED_GOTO
+	if (m_dispatch == dispatch_t::threaded)
+		return evaluate_threaded(begin, end, stack_size, variables, results);
+#endif
+
+	return evaluate_portable(begin, end, stack_size, variables, results);
+}
+
+// -----------------------------------------------------------------------------
+
+// PARALLEL EVALUATION
+
+// a rough relative cost, with an arithmetic operation being 1
+size_t evaluator_t::instruction_cost(const instruction_t instruction) const
+{
+	switch (instruction.opcode())
+	{
+	case opcode_t::FUNCTION:
+		return 16 + m_functions[instruction.payload()].m_param_count;
+	case opcode_t::UNARY:
+	case opcode_t::OPERATOR:
+	case opcode_t::SELECT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+size_t evaluator_t::program_cost(const std::vector<instruction_t>& instructions) const
+{
+	size_t cost = 0;
+	for (const instruction_t instruction : instructions)
+		cost += instruction_cost(instruction);
+	return cost;
+}
+
+// the program is cut into independent subtrees, each of which is evaluated on
+// the pool, then whatever is left (the skeleton joining them together) is
+// evaluated with each subtree swapped for a RESULT, so the operations are
+// exactly the same and happen in the same order, making the result bit for bit
+// the same as evaluating it serially
+double evaluator_t::evaluate_parallel(const program_t& program, const double* variables) const
+{
+	const std::vector<instruction_t>& instructions = program.m_instructions;
+
+	// aim for a few tasks per thread, so uneven subtrees still balance out
+	const size_t grain = std::max<size_t>(program.m_cost / (m_task_pool->thread_count() * 4 + 1), 1);
+
+	// every subtree of a postfix program is contiguous, so one pass with a stack
+	// of operands is enough to find them, once an operation would make a subtree
+	// cost more than a grain, its children are cut off as tasks and the
+	// operation itself is left in the skeleton
+	struct operand_t
+	{
+		size_t m_start;
+		size_t m_cost;
+		bool m_cut; // has tasks cut from it, so it has to stay in the skeleton
+	};
+
+	struct task_t
+	{
+		size_t m_start;
+		size_t m_end;
+		size_t m_cost;
+	};
+
+	std::vector<operand_t> operand_stack(program.m_stack_size + 1);
+	operand_t* const operands = operand_stack.data();
+	size_t top = 0;
+
+	std::vector<task_t> tasks;
+
+	// nothing is cut from inside the branches of a select, they mightn't be
+	// taken, and the jumps over them would no longer line up
+	size_t branch_depth = 0;
+
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		const instruction_t instruction = instructions[i];
+		const opcode_t opcode = instruction.opcode();
+
+		if (opcode == opcode_t::NUMBER || opcode == opcode_t::CONSTANT || opcode == opcode_t::VARIABLE)
+		{
+			operands[top++] = { i, 0, false };
+			continue;
+		}
+
+		if (opcode == opcode_t::JUMP_IF_ZERO)
+			branch_depth++;
+		if (opcode == opcode_t::JUMP_IF_ZERO || opcode == opcode_t::JUMP)
+			continue;
+		if (opcode == opcode_t::SELECT)
+			branch_depth--;
+
+		const size_t param_count = opcode == opcode_t::FUNCTION ? m_functions[instruction.payload()].m_param_count
+			: opcode == opcode_t::SELECT ? 3 : opcode == opcode_t::OPERATOR ? 2 : 1;
+
+		const size_t first = top - param_count;
+
+		operand_t operand = { param_count > 0 ? operands[first].m_start : i, instruction_cost(instruction), false };
+		for (size_t j = first; j < top; j++)
+		{
+			operand.m_cost += operands[j].m_cost;
+			operand.m_cut = operand.m_cut || operands[j].m_cut;
+		}
+
+		if (branch_depth == 0 && (operand.m_cut || operand.m_cost > grain))
+		{
+			// only the condition of a select can be cut, it ends at the jump
+			const size_t last = opcode == opcode_t::SELECT ? first + 1 : top;
+
+			for (size_t j = first; j < last; j++)
+			{
+				// single values aren't worth a task
+				if (!operands[j].m_cut && operands[j].m_cost > 0)
+				{
+					const size_t end = j + 1 < top ? operands[j + 1].m_start - (opcode == opcode_t::SELECT ? 1 : 0) : i;
+					tasks.push_back({ operands[j].m_start, end, operands[j].m_cost });
+				}
+			}
+			operand.m_cut = true;
+		}
+
+		top = first;
+		operands[top++] = operand;
+	}
+
+	const instruction_t* const begin = instructions.data();
+
+	if (tasks.empty())
+		return evaluate_range(begin, begin + instructions.size(), program.m_stack_size, variables);
+
+	// children are only cut once their parent is reached, so a task can be
+	// found after others which come after it
+	std::sort(tasks.begin(), tasks.end(), [](const task_t& a, const task_t& b) { return a.m_start < b.m_start; });
+
+	// neighbouring tasks are grouped until they make up a grain's worth
+	std::vector<size_t> group_ends;
+	{
+		size_t group_cost = 0;
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			group_cost += tasks[i].m_cost;
+			if (group_cost >= grain || i + 1 == tasks.size())
+			{
+				group_ends.push_back(i + 1);
+				group_cost = 0;
+			}
+		}
+	}
+
+	std::vector<double> task_results(tasks.size());
+	std::vector<std::exception_ptr> group_errors(group_ends.size());
+
+	m_task_pool->run(group_ends.size(), [&](const size_t group)
+		{
+			try
+			{
+				for (size_t i = group == 0 ? 0 : group_ends[group - 1]; i < group_ends[group]; i++)
+					task_results[i] = evaluate_range(begin + tasks[i].m_start, begin + tasks[i].m_end, program.m_stack_size, variables);
+			}
+			catch (...)
+			{
+				group_errors[group] = std::current_exception();
+			}
+		});
+
+	for (const std::exception_ptr& error : group_errors)
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	std::vector<instruction_t> skeleton;
+
+	size_t next = 0;
+	for (size_t i = 0; i < tasks.size(); i++)
+	{
+		skeleton.insert(skeleton.end(), begin + next, begin + tasks[i].m_start);
+		skeleton.push_back(instruction_t::boxed(opcode_t::RESULT, i));
+		next = tasks[i].m_end;
+	}
+	skeleton.insert(skeleton.end(), begin + next, begin + instructions.size());
+
+	return evaluate_range(skeleton.data(), skeleton.data() + skeleton.size(), program.m_stack_size, variables, task_results.data());
+}
+
+// -----------------------------------------------------------------------------
+
+double evaluator_t::apply_unary(const size_t unary_id, const double x) const
+{
+	const unary_info_t& info = m_unaries[unary_id];
+
+	if (!info.m_validator(x))
+		throw evaluation_exception(lazy_format("unary validator failed (%c)", info.m_symbol));
+
+	return info.m_operation(x);
+}
+
+double evaluator_t::apply_operator(const size_t operator_id, const double a, const double b) const
+{
+	const operator_info_t& info = m_operators[operator_id];
+
+	if (!info.m_validator(a, b))
+		throw evaluation_exception(lazy_format("operator validator failed (%c)", info.m_symbol));
+
+	return info.m_operation(a, b);
+}
+
+double evaluator_t::evaluate_portable(const instruction_t* const begin, const instruction_t* const end, const size_t stack_size, const double* variables, const double* results) const
+{
+	// a default constructed program leaves nothing on the stack
+	if (begin == end)
+		throw evaluation_exception("empty program");
+
+	double local_stack[64];
+	std::unique_ptr<double[]> heap_stack;
+	double* stack = local_stack;
+
+	if (stack_size > 64)
+	{
+		heap_stack = std::make_unique<double[]>(stack_size);
+		stack = heap_stack.get();
+	}
+
+	size_t top = 0;
+
+	for (const instruction_t* ip = begin; ip != end; ++ip)
+	{
+		const instruction_t instruction = *ip;
+
+		switch (instruction.opcode())
+		{
+		case opcode_t::NUMBER:
+			stack[top++] = instruction.value();
+			break;
+		case opcode_t::CONSTANT:
+			stack[top++] = m_constants[instruction.payload()].m_value;
+			break;
+		case opcode_t::VARIABLE:
+			if (variables == nullptr)
+				throw evaluation_exception("no value given for variable (" + m_variables[instruction.payload()] + ")");
+
+			stack[top++] = variables[instruction.payload()];
+			break;
+		case opcode_t::UNARY:
+			stack[top - 1] = apply_unary(instruction.payload(), stack[top - 1]);
+			break;
+		case opcode_t::OPERATOR:
+			top--;
+			stack[top - 1] = apply_operator(instruction.payload(), stack[top - 1], stack[top]);
+			break;
+		case opcode_t::FUNCTION:
+			top -= m_functions[instruction.payload()].m_param_count;
+			stack[top] = call_function(instruction.payload(), stack + top);
+			top++;
+			break;
+		case opcode_t::JUMP_IF_ZERO:
+			// the loop steps past the last one
+			if (stack[--top] == 0)
+				ip += instruction.payload() - 1;
+			break;
+		case opcode_t::JUMP:
+			ip += instruction.payload() - 1;
+			break;
+		case opcode_t::SELECT:
+			// the jumps have already picked the branch
+			break;
+		case opcode_t::RESULT:
+			stack[top++] = results[instruction.payload()];
+			break;
+		default:
+			// shouldn't happen, unless someone's been fiddling with the program...
+			throw evaluation_exception("unknown instruction in program");
+		}
+	}
+
+	return stack[0];
+}
+
+#ifdef EVAL_HAS_COMPUTED_GOTO
+// same as evaluate_portable, but each handler jumps straight to the next one
+// through a table of label addresses, rather than everything going back through
+// the one switch, so the branch predictor gets a separate history per handler
+double evaluator_t::evaluate_threaded(const instruction_t* ip, const instruction_t* const end, const size_t stack_size, const double* variables, const double* results) const
+{
+	if (ip == end)
+		throw evaluation_exception("empty program");
+
+	// indexed by opcode_t, which is 4 bits
+	static const void* const handlers[16] = {
+		&&number, &&constant, &&operator_, &&unary, &&function, &&variable,
+		&&jump_if_zero, &&jump, &&select, &&result,
+		&&unknown, &&unknown, &&unknown, &&unknown, &&unknown, &&unknown
+	};
+
+	double local_stack[64];
+	std::unique_ptr<double[]> heap_stack;
+	double* stack = local_stack;
+
+	if (stack_size > 64)
+	{
+		heap_stack = std::make_unique<double[]>(stack_size);
+		stack = heap_stack.get();
+	}
+
+	double* top = stack;
+
+#define EVAL_DISPATCH() \
+	if (ip == end) goto done; \
+	goto *handlers[static_cast<size_t>(ip->opcode())]
+
+	EVAL_DISPATCH();
+
+number:
+	*top++ = ip->value();
+	ip++;
+	EVAL_DISPATCH();
+
+constant:
+	*top++ = m_constants[ip->payload()].m_value;
+	ip++;
+	EVAL_DISPATCH();
+
+variable:
+	if (variables == nullptr)
+		throw evaluation_exception("no value given for variable (" + m_variables[ip->payload()] + ")");
+
+	*top++ = variables[ip->payload()];
+	ip++;
+	EVAL_DISPATCH();
+
+unary:
+	top[-1] = apply_unary(ip->payload(), top[-1]);
+	ip++;
+	EVAL_DISPATCH();
+
+operator_:
+	top--;
+	top[-1] = apply_operator(ip->payload(), top[-1], top[0]);
+	ip++;
+	EVAL_DISPATCH();
+
+function:
+	top -= m_functions[ip->payload()].m_param_count;
+	*top = call_function(ip->payload(), top);
+	top++;
+	ip++;
+	EVAL_DISPATCH();
+
+jump_if_zero:
+	ip += *--top == 0 ? ip->payload() : 1;
+	EVAL_DISPATCH();
+
+jump:
+	ip += ip->payload();
+	EVAL_DISPATCH();
+
+select:
+	ip++;
+	EVAL_DISPATCH();
+
+result:
+	*top++ = results[ip->payload()];
+	ip++;
+	EVAL_DISPATCH();
+
+unknown:
+	// shouldn't happen, unless someone's been fiddling with the program...
+	throw evaluation_exception("unknown instruction in program");
+
+#undef EVAL_DISPATCH
+
+done:
+	return stack[0];
+}
+#endif
+
+void evaluator_t::evaluate(const program_t& program, const size_t rows, const double* const* variables, double* results, bool* valid) const
+{
+	if (program.m_instructions.empty())
+		throw evaluation_exception("empty program");
+
+	// rows are evaluated a block at a time, each stack slot being a column of
+	// block_rows values, small enough that the whole stack stays in cache, so
+	// deep programs get narrower blocks, and no more rows than there are
+	const size_t slots = program.m_stack_size + 1; // one extra for function results
+	const size_t block_rows = std::max<size_t>(std::min<size_t>({ 256, (1 << 16) / slots, rows }), 1);
+
+	// every slot is written before it's read, so there's no need to clear them
+	const auto values = std::unique_ptr<double[]>(new double[slots * block_rows]);
+	const auto slot_valid = std::unique_ptr<bool[]>(new bool[slots * block_rows]);
+
+	for (size_t begin = 0; begin < rows; begin += block_rows)
+	{
+		const size_t n = std::min(block_rows, rows - begin);
+		size_t top = 0;
+
+		auto column = [&](const size_t slot) { return values.get() + slot * block_rows; };
+		auto column_valid = [&](const size_t slot) { return slot_valid.get() + slot * block_rows; };
+
+		auto push = [&](const double value)
+			{
+				std::fill_n(column(top), n, value);
+				std::fill_n(column_valid(top), n, true);
+				top++;
+			};
+
+		for (const instruction_t instruction : program.m_instructions)
+		{
+			switch (instruction.opcode())
+			{
+			case opcode_t::NUMBER:
+				push(instruction.value());
+				break;
+			case opcode_t::CONSTANT:
+				push(m_constants[instruction.payload()].m_value);
+				break;
+			case opcode_t::VARIABLE:
+				if (variables == nullptr)
+					throw evaluation_exception("no value given for variable (" + m_variables[instruction.payload()] + ")");
+
+				std::copy_n(variables[instruction.payload()] + begin, n, column(top));
+				std::fill_n(column_valid(top), n, true);
+				top++;
+				break;
+			case opcode_t::UNARY:
+			{
+				const auto& unary_info = m_unaries[instruction.payload()];
+
+				double* x = column(top - 1);
+				bool* x_valid = column_valid(top - 1);
+
+				for (size_t r = 0; r < n; r++)
+				{
+					if (x_valid[r] && unary_info.m_validator(x[r]))
+						x[r] = unary_info.m_operation(x[r]);
+					else
+						x_valid[r] = false;
+				}
+				break;
+			}
+			case opcode_t::OPERATOR:
+			{
+				const auto& operator_info = m_operators[instruction.payload()];
+
+				top--;
+				double* a = column(top - 1);
+				const double* b = column(top);
+				bool* a_valid = column_valid(top - 1);
+				const bool* b_valid = column_valid(top);
+
+				for (size_t r = 0; r < n; r++)
+				{
+					if (a_valid[r] && b_valid[r] && operator_info.m_validator(a[r], b[r]))
+						a[r] = operator_info.m_operation(a[r], b[r]);
+					else
+						a_valid[r] = false;
+				}
+				break;
+			}
+			case opcode_t::FUNCTION:
+			{
+				const auto& function_info = m_functions[instruction.payload()];
+
+				top -= function_info.m_param_count;
+
+				// a row is only worth calling if all of its arguments are valid
+				bool* result_valid = column_valid(slots - 1);
+				std::fill_n(result_valid, n, true);
+				for (size_t i = 0; i < function_info.m_param_count; i++)
+				{
+					const bool* arg_valid = column_valid(top + i);
+					for (size_t r = 0; r < n; r++)
+						result_valid[r] = result_valid[r] && arg_valid[r];
+				}
+
+				call_function(instruction.payload(), n, block_rows, column(top), column(slots - 1), result_valid);
+
+				std::copy_n(column(slots - 1), n, column(top));
+				std::copy_n(result_valid, n, column_valid(top));
+				top++;
+				break;
+			}
+			case opcode_t::JUMP_IF_ZERO:
+			case opcode_t::JUMP:
+				// every row goes down both branches, SELECT picks between them
+				break;
+			case opcode_t::SELECT:
+			{
+				top -= 2;
+				double* c = column(top - 1);
+				const double* a = column(top);
+				const double* b = column(top + 1);
+				bool* c_valid = column_valid(top - 1);
+				const bool* a_valid = column_valid(top);
+				const bool* b_valid = column_valid(top + 1);
+
+				// no branches, so the compiler can turn this into blends
+				for (size_t r = 0; r < n; r++)
+				{
+					const bool pick_a = c[r] != 0;
+					c_valid[r] = c_valid[r] && (pick_a ? a_valid[r] : b_valid[r]);
+					c[r] = pick_a ? a[r] : b[r];
+				}
+				break;
+			}
+			default:
+				// shouldn't happen, unless someone's been fiddling with the program...
+				throw evaluation_exception("unknown instruction in program");
+			}
+		}
+
+		const double* result = column(0);
+		const bool* result_valid = column_valid(0);
+
+		for (size_t r = 0; r < n; r++)
+		{
+			if (result_valid[r])
+			{
+				results[begin + r] = result[r];
+			}
+			else if (valid == nullptr)
+			{
+				throw evaluation_exception(lazy_format("validator failed in row %llu", begin + r));
+			}
+			else
+			{
+				results[begin + r] = std::numeric_limits<double>::quiet_NaN();
+			}
+		}
+
+		if (valid != nullptr)
+			std::copy_n(result_valid, n, valid + begin);
+	}
+}
+
+program_t evaluator_t::specialise(const program_t& program, const std::map<std::string, double>& bindings) const
+{
+	std::vector<bool> variable_bound(m_variables.size(), false);
+	std::vector<double> variable_values(m_variables.size());
+
+	std::vector<double> constant_values(m_constants.size());
+	for (size_t i = 0; i < m_constants.size(); i++)
+		constant_values[i] = m_constants[i].m_value;
+
+	for (const auto& binding : bindings)
+	{
+		const auto variable_it = m_variable_name_map.find(binding.first);
+		const auto constant_it = m_constant_name_map.find(binding.first);
+
+		if (variable_it != m_variable_name_map.end())
+		{
+			variable_bound[variable_it->second] = true;
+			variable_values[variable_it->second] = binding.second;
+		}
+		else if (constant_it != m_constant_name_map.end())
+		{
+			constant_values[constant_it->second] = binding.second;
+		}
+		else
+		{
+			throw parse_exception("no variable or constant named " + binding.first);
+		}
+	}
+
+	// every subtree of a postfix program is contiguous, so each value on this
+	// stack remembers where its code starts, once all of an operation's operands
+	// are known, their code is dropped and replaced with the result
+	struct operand_t
+	{
+		size_t m_start;
+		bool m_known;
+		double m_value;
+	};
+
+	std::vector<operand_t> stack;
+	stack.reserve(program.m_stack_size);
+
+	program_t residual;
+	std::vector<instruction_t>& output = residual.m_instructions;
+	output.reserve(program.m_instructions.size());
+
+	auto push_known = [&](const size_t start, const double value)
+		{
+			output.resize(start);
+			output.push_back(instruction_t::number(value));
+			stack.push_back({ start, true, value });
+		};
+
+	std::vector<double> args;
+
+	// the selects currently open, if the condition's known only the branch that's
+	// taken is kept, in place of the whole select, otherwise both are kept and
+	// their jumps fixed up once the select is reached
+	struct branch_t
+	{
+		bool m_known;
+		size_t m_jump_if_zero;
+		size_t m_jump;
+	};
+
+	std::vector<branch_t> branches;
+	size_t unknown_branches = 0;
+
+	const std::vector<instruction_t>& instructions = program.m_instructions;
+
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		const instruction_t instruction = instructions[i];
+
+		switch (instruction.opcode())
+		{
+		case opcode_t::NUMBER:
+			push_known(output.size(), instruction.value());
+			continue;
+		case opcode_t::CONSTANT:
+			push_known(output.size(), constant_values[instruction.payload()]);
+			continue;
+		case opcode_t::VARIABLE:
+			if (variable_bound[instruction.payload()])
+			{
+				push_known(output.size(), variable_values[instruction.payload()]);
+			}
+			else
+			{
+				stack.push_back({ output.size(), false, 0 });
+				output.push_back(instruction);
+			}
+			continue;
+		case opcode_t::JUMP_IF_ZERO:
+		{
+			const operand_t condition = stack.back();
+			if (condition.m_known)
+			{
+				stack.pop_back();
+				output.resize(condition.m_start);
+				branches.push_back({ true, 0, 0 });
+
+				// the loop steps past the last one
+				if (condition.m_value == 0)
+					i += instruction.payload() - 1;
+			}
+			else
+			{
+				branches.push_back({ false, output.size(), 0 });
+				output.push_back(instruction);
+				unknown_branches++;
+			}
+			continue;
+		}
+		case opcode_t::JUMP:
+			if (branches.back().m_known)
+			{
+				// the first branch was taken, so skip the second and the select
+				branches.pop_back();
+				i += instruction.payload() - 1;
+			}
+			else
+			{
+				branches.back().m_jump = output.size();
+				output.push_back(instruction);
+			}
+			continue;
+		case opcode_t::SELECT:
+		{
+			const branch_t branch = branches.back();
+			branches.pop_back();
+
+			if (branch.m_known)
+				continue;
+
+			unknown_branches--;
+
+			output[branch.m_jump_if_zero] = instruction_t::boxed(opcode_t::JUMP_IF_ZERO, branch.m_jump + 1 - branch.m_jump_if_zero);
+			output[branch.m_jump] = instruction_t::boxed(opcode_t::JUMP, output.size() + 1 - branch.m_jump);
+			output.push_back(instruction);
+
+			const size_t start = stack[stack.size() - 3].m_start;
+			stack.resize(stack.size() - 3);
+			stack.push_back({ start, false, 0 });
+			continue;
+		}
+		default:
+			break;
+		}
+
+		size_t param_count = 0;
+		switch (instruction.opcode())
+		{
+		case opcode_t::UNARY: param_count = 1; break;
+		case opcode_t::OPERATOR: param_count = 2; break;
+		case opcode_t::FUNCTION: param_count = m_functions[instruction.payload()].m_param_count; break;
+		default:
+			// shouldn't happen, unless someone's been fiddling with the program...
+			throw evaluation_exception("unknown instruction in program");
+		}
+
+		const size_t first = stack.size() - param_count;
+		const size_t start = param_count > 0 ? stack[first].m_start : output.size();
+
+		bool known = true;
+		args.clear();
+		for (size_t j = first; j < stack.size(); j++)
+		{
+			known = known && stack[j].m_known;
+			args.push_back(stack[j].m_value);
+		}
+
+		stack.resize(first);
+
+		if (!known)
+		{
+			output.push_back(instruction);
+			stack.push_back({ start, false, 0 });
+			continue;
+		}
+
+		double value;
+		try
+		{
+			switch (instruction.opcode())
+			{
+			case opcode_t::UNARY:
+				value = apply_unary(instruction.payload(), args[0]);
+				break;
+			case opcode_t::OPERATOR:
+				value = apply_operator(instruction.payload(), args[0], args[1]);
+				break;
+			default:
+				value = call_function(instruction.payload(), args.data());
+				break;
+			}
+		}
+		catch (const evaluation_exception&)
+		{
+			// a branch that mightn't be taken is allowed to fail, it's left as it is
+			if (unknown_branches == 0)
+				throw;
+
+			output.push_back(instruction);
+			stack.push_back({ start, false, 0 });
+			continue;
+		}
+
+		push_known(start, value);
+	}
+
+	// folding can only ever shrink the stack, but it's cheap enough to recount
+	size_t depth = 0;
+	residual.m_stack_size = 0;
+	for (const instruction_t instruction : output)
+	{
+		switch (instruction.opcode())
+		{
+		case opcode_t::UNARY: depth -= 1; break;
+		case opcode_t::OPERATOR: depth -= 2; break;
+		case opcode_t::FUNCTION: depth -= m_functions[instruction.payload()].m_param_count; break;
+		case opcode_t::SELECT: depth -= 3; break;
+		case opcode_t::JUMP_IF_ZERO: case opcode_t::JUMP: continue;
+		default: break;
+		}
+
+		residual.m_stack_size = std::max(residual.m_stack_size, ++depth);
+	}
+
+	residual.m_cost = program_cost(output);
+	return residual;
+}
+
+double evaluator_t::evaluate(std::list<token_t> postfix_tokens) const
+{
+	return evaluate(compile(postfix_tokens));
+}
 
 // -----------------------------------------------------------------------------
 
 std::list<token_t> evaluator_t::parse(const std::string& expression) const
 {
-	return to_postfix(tokenise(expression));
+	const std::vector<token_t> postfix_tokens = to_postfix(tokenise(expression));
+	return std::list<token_t>(postfix_tokens.begin(), postfix_tokens.end());
 }
 
 double evaluator_t::evaluate(const std::string& expression) const
 {
-	return evaluate(parse(expression));
+	return evaluate(compile(expression));
 }
 
 double evaluator_t::operator()(const std::string& expression) const
@@ -566,32 +2124,88 @@ double evaluator_t::operator()(const std::string& expression) const
 
 // -----------------------------------------------------------------------------
 
+evaluator_t::evaluator_t()
+	: m_pipe_has_associated_function(false), m_pipe_associated_function_id(0)
+	, m_max_length(std::numeric_limits<size_t>::max()), m_max_depth(std::numeric_limits<size_t>::max())
+	, m_dispatch(dispatch_t::threaded), m_lexer(lexer_t::simd), m_precision(precision_t::exact)
+	, m_task_pool(nullptr), m_parallel_cost_threshold(0)
+{
+	std::fill_n(m_char_class, 256, static_cast<unsigned char>(0));
+}
+
+// -----------------------------------------------------------------------------
+
 evaluator_t &evaluator_t::add_constant(const constant_info_t& info)
 {
 	const size_t id = m_constants.size();
 	m_constants.push_back(info);
-	m_constant_name_map.emplace(info.m_name, id);
+	if (m_constant_name_map.emplace(info.m_name, id).second)
+		m_identifiers.insert(info.m_name, token_type::CONSTANT, id);
 	return *this;
 }
 
 
 evaluator_t& evaluator_t::add_operator(const operator_info_t& info)
 {
-	m_operator_map.emplace(info.m_symbol, info);
+	if (m_operator_symbol_map.emplace(info.m_symbol, m_operators.size()).second)
+	{
+		m_operators.push_back(info);
+		m_char_class[static_cast<unsigned char>(info.m_symbol)] |= char_class_operator;
+	}
 	return *this;
 }
 
 evaluator_t& evaluator_t::add_unary(const unary_info_t& info)
 {
-	m_unary_map.emplace(info.m_symbol, info);
+	if (m_unary_symbol_map.emplace(info.m_symbol, m_unaries.size()).second)
+	{
+		m_unaries.push_back(info);
+		m_char_class[static_cast<unsigned char>(info.m_symbol)] |=
+			info.m_associativity == associativity_t::right ? char_class_right_unary : char_class_left_unary;
+	}
 	return *this;
 }
 
+const operator_info_t& evaluator_t::operator_info(const char symbol) const
+{
+	return m_operators[m_operator_symbol_map.find(symbol)->second];
+}
+
+const unary_info_t& evaluator_t::unary_info(const char symbol) const
+{
+	return m_unaries[m_unary_symbol_map.find(symbol)->second];
+}
+
 evaluator_t &evaluator_t::add_function(const function_info_t& info)
 {
 	const size_t id = m_functions.size();
 	m_functions.push_back(info);
-	m_function_name_map.emplace(info.m_name, id);
+	if (m_function_name_map.emplace(info.m_name, id).second)
+		m_identifiers.insert(info.m_name, token_type::FUNCTION, id);
+	m_function_caches.push_back(info.m_cache_size == 0 ? nullptr
+		: std::make_shared<function_cache_t>(info.m_param_count, info.m_cache_size));
+
+	// the built in functions with faster approximations
+	const function_info_t* fast_function = nullptr;
+	if (info.m_function != nullptr && info.m_function == functions::exp.m_function)
+		fast_function = &functions::fast::exp;
+	else if (info.m_function != nullptr && info.m_function == functions::log.m_function)
+		fast_function = &functions::fast::log;
+	m_fast_functions.push_back(fast_function);
+
+	m_select_functions.push_back(info.m_function != nullptr && info.m_function == functions::select.m_function && info.m_param_count == 3);
+
+	return *this;
+}
+
+// -----------------------------------------------------------------------------
+
+evaluator_t& evaluator_t::add_variable(const std::string& name)
+{
+	const size_t id = m_variables.size();
+	m_variables.push_back(name);
+	if (m_variable_name_map.emplace(name, id).second)
+		m_identifiers.insert(name, token_type::VARIABLE, id);
 	return *this;
 }
 
@@ -615,6 +2229,80 @@ evaluator_t& evaluator_t::dissociate_pipe()
 	return *this;
 }
 
+// -----------------------------------------------------------------------------
+
+evaluator_t& evaluator_t::set_max_length(const size_t max_length)
+{
+	m_max_length = max_length;
+	return *this;
+}
+
+evaluator_t& evaluator_t::set_max_depth(const size_t max_depth)
+{
+	m_max_depth = max_depth;
+	return *this;
+}
+
+evaluator_t& evaluator_t::set_dispatch(const dispatch_t dispatch)
+{
+	m_dispatch = dispatch;
+	return *this;
+}
+
+evaluator_t& evaluator_t::set_lexer(const lexer_t lexer)
+{
+	m_lexer = lexer;
+	return *this;
+}
+
+evaluator_t& evaluator_t::set_precision(const precision_t precision)
+{
+	m_precision = precision;
+	return *this;
+}
+
+evaluator_t& evaluator_t::set_parallelism(task_pool_t* const task_pool, const size_t cost_threshold)
+{
+	m_task_pool = task_pool;
+	m_parallel_cost_threshold = cost_threshold;
+	return *this;
+}
+
+// -----------------------------------------------------------------------------
+
+function_cache_stats_t evaluator_t::cache_stats(const std::string& function_name) const
+{
+	function_cache_stats_t stats = {};
+
+	const auto function_it = m_function_name_map.find(function_name);
+	if (function_it == m_function_name_map.end())
+		return stats;
+
+	function_cache_t* const cache = m_function_caches[function_it->second].get();
+	if (cache == nullptr)
+		return stats;
+
+	std::lock_guard<std::mutex> lock(cache->m_mutex);
+	stats.m_hits = cache->m_hits;
+	stats.m_misses = cache->m_misses;
+	return stats;
+}
+
+const std::vector<std::string>& evaluator_t::variables() const
+{
+	return m_variables;
+}
+
+bool evaluator_t::is_pure(const program_t& program) const
+{
+	for (const instruction_t instruction : program.m_instructions)
+	{
+		if (instruction.opcode() == opcode_t::FUNCTION && m_functions[instruction.payload()].m_cache_size == 0)
+			return false;
+	}
+
+	return true;
+}
 
 // -----------------------------------------------------------------------------
 
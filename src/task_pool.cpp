@@ -0,0 +1,126 @@
+#include "eval/task_pool.h"
+
+#include <atomic>
+
+namespace eval
+{
+
+// -----------------------------------------------------------------------------
+
+struct task_pool_t::job_t
+{
+	job_t(const size_t count, const std::function<void(size_t)>& task)
+		: m_task(task), m_count(count), m_next(0), m_remaining(count)
+	{
+	}
+
+	// takes and runs tasks until there are none left, returns false if there
+	// weren't any to take in the first place
+	bool work()
+	{
+		bool worked = false;
+
+		for (size_t i; (i = m_next.fetch_add(1)) < m_count;)
+		{
+			m_task(i);
+			worked = true;
+
+			if (m_remaining.fetch_sub(1) == 1)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_finished.notify_all();
+			}
+		}
+
+		return worked;
+	}
+
+	const std::function<void(size_t)>& m_task;
+	const size_t m_count;
+
+	std::atomic<size_t> m_next;
+	std::atomic<size_t> m_remaining;
+
+	std::mutex m_mutex;
+	std::condition_variable m_finished;
+};
+
+// -----------------------------------------------------------------------------
+
+task_pool_t::task_pool_t(const size_t thread_count)
+	: m_stopping(false)
+{
+	for (size_t i = 0; i < thread_count; i++)
+		m_threads.emplace_back(&task_pool_t::worker, this);
+}
+
+task_pool_t::~task_pool_t()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_wake.notify_all();
+
+	for (std::thread& thread : m_threads)
+		thread.join();
+}
+
+size_t task_pool_t::thread_count() const
+{
+	return m_threads.size();
+}
+
+void task_pool_t::run(const size_t count, const std::function<void(size_t)>& task)
+{
+	if (count == 0)
+		return;
+
+	const auto job = std::make_shared<job_t>(count, task);
+
+	if (count > 1 && !m_threads.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobs.push_back(job);
+		}
+		m_wake.notify_all();
+	}
+
+	job->work();
+
+	std::unique_lock<std::mutex> lock(job->m_mutex);
+	job->m_finished.wait(lock, [&] { return job->m_remaining == 0; });
+}
+
+void task_pool_t::worker()
+{
+	for (;;)
+	{
+		std::shared_ptr<job_t> job;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_stopping || !m_jobs.empty(); });
+
+			if (m_jobs.empty())
+				return;
+
+			job = m_jobs.front();
+		}
+
+		// a job with nothing left to take is finished as far as the workers are
+		// concerned, even if whoever is running its last task hasn't returned yet
+		if (!job->work())
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_jobs.empty() && m_jobs.front() == job)
+				m_jobs.pop_front();
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,287 @@
+#include <atomic>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "eval/async_evaluator.h"
+#include "eval/evaluator.h"
+
+// stress test of the pipeline, several threads submitting at once, every request
+// should come back with exactly what evaluating it synchronously gives, result
+// or exception, impure functions should be called once per request, and the
+// destructor should finish everything that was accepted
+
+namespace
+{
+
+const char* const expressions[] = {
+	"1+2*3", "sqrt(16)", "pow(2, 10) - 1", "|pi - 4|", "select(1 < 2, log(3), log(0-1))",
+	"twice(21)", "twice(1.5) + twice(2)", "exp(1)*0 + e",
+	"sqrt(0-1)", "log(0)", "twice(0-1)",
+	"1 +", "nosuch(2)", "(1", "",
+	"tick(0)",
+};
+
+// pure, so the pipeline may share one result between requests in a row
+double twice(const double* args) { return args[0] * 2; }
+bool twice_valid(const double* args) { return args[0] >= 0; }
+
+// not pure, every request has to get its own call
+std::atomic<size_t> ticks(0);
+double tick(const double* args) { return static_cast<double>(++ticks); }
+
+bool is_impure(const std::string& expression)
+{
+	return expression == "tick(0)";
+}
+
+struct outcome_t
+{
+	double m_result = 0;
+	std::string m_error; // empty on success, otherwise the kind and message
+};
+
+std::string describe(const std::exception_ptr& error)
+{
+	try
+	{
+		std::rethrow_exception(error);
+	}
+	catch (const eval::parse_exception& e)
+	{
+		return std::string("parse_exception: ") + e.what();
+	}
+	catch (const eval::evaluation_exception& e)
+	{
+		return std::string("evaluation_exception: ") + e.what();
+	}
+	catch (...)
+	{
+		return "something else";
+	}
+}
+
+outcome_t evaluate_synchronously(const eval::evaluator_t& evaluate, const std::string& expression)
+{
+	outcome_t outcome;
+	try
+	{
+		outcome.m_result = evaluate(expression);
+	}
+	catch (...)
+	{
+		outcome.m_error = describe(std::current_exception());
+	}
+	return outcome;
+}
+
+bool same(const outcome_t& a, const outcome_t& b)
+{
+	return a.m_error == b.m_error && std::memcmp(&a.m_result, &b.m_result, sizeof(double)) == 0;
+}
+
+// one per request, written by whichever way it completes
+struct request_t
+{
+	size_t m_expression;
+	std::future<double> m_future; // invalid for callbacks
+	std::atomic<bool> m_called{ false };
+	outcome_t m_outcome;
+};
+
+}
+
+int main(int argc, char const* argv[])
+{
+	eval::evaluator_t evaluate;
+
+	evaluate.add_operator(eval::operators::add);
+	evaluate.add_operator(eval::operators::subtract);
+	evaluate.add_operator(eval::operators::multiply);
+	evaluate.add_operator(eval::operators::less);
+
+	evaluate.add_function(eval::functions::abs);
+	evaluate.add_function(eval::functions::sqrt);
+	evaluate.add_function(eval::functions::pow);
+	evaluate.add_function(eval::functions::log);
+	evaluate.add_function(eval::functions::exp);
+	evaluate.add_function(eval::functions::select);
+	evaluate.add_function(eval::function_info_t("twice", 1, twice, twice_valid, 16));
+	evaluate.add_function(eval::function_info_t("tick", 1, tick));
+
+	evaluate.add_constant(eval::constants::pi);
+	evaluate.add_constant(eval::constants::e);
+
+	evaluate.associate_pipe_with_implicit_function("abs");
+
+	const size_t expression_count = sizeof(expressions) / sizeof(expressions[0]);
+
+	std::vector<outcome_t> expected;
+	for (const char* const expression : expressions)
+		expected.push_back(evaluate_synchronously(evaluate, expression));
+
+	const size_t requests_per_thread = argc > 1 ? std::stoul(argv[1]) : 3000;
+	const size_t submitters = 4;
+
+	// tiny queues keep every stage blocking and waking, big ones leave plenty in
+	// flight for the destructor to finish
+	struct round_t
+	{
+		size_t m_queue_capacity;
+		size_t m_cache_size;
+		size_t m_evaluate_threads;
+	};
+
+	const round_t rounds[] = {
+		{ 2, 0, 1 }, { 2, 0, 3 }, { 2, 4, 1 }, { 2, 4, 3 },
+		{ 4096, 0, 1 }, { 4096, 0, 3 }, { 4096, 4, 1 }, { 4096, 4, 3 },
+	};
+
+	for (size_t round = 0; round < sizeof(rounds) / sizeof(rounds[0]); round++)
+	{
+		eval::async_options_t options;
+		options.m_queue_capacity = rounds[round].m_queue_capacity;
+		options.m_batch_size = 3;
+		options.m_cache_size = rounds[round].m_cache_size;
+		options.m_evaluate_threads = rounds[round].m_evaluate_threads;
+
+		ticks = 0;
+
+		std::vector<std::vector<std::unique_ptr<request_t>>> requests(submitters);
+		std::atomic<size_t> rejected(0);
+		eval::async_stats_t stats;
+
+		{
+			eval::async_evaluator_t async(evaluate, options);
+
+			std::vector<std::thread> threads;
+			for (size_t t = 0; t < submitters; t++)
+			{
+				threads.emplace_back([&, t] {
+					std::mt19937 rng(static_cast<unsigned>(round * submitters + t));
+					size_t expression = 0;
+
+					for (size_t i = 0; i < requests_per_thread; i++)
+					{
+						// runs of the same expression, so results get shared
+						if (rng() % 3 != 0)
+							expression = rng() % expression_count;
+
+						auto request = std::make_unique<request_t>();
+						request->m_expression = expression;
+						request_t* const pointer = request.get();
+
+						auto callback = [pointer](const double result, const std::exception_ptr error) {
+							pointer->m_outcome.m_result = error ? 0 : result;
+							pointer->m_outcome.m_error = error ? describe(error) : "";
+							pointer->m_called = true;
+						};
+
+						bool accepted = true;
+						switch (rng() % 4)
+						{
+						case 0:
+							request->m_future = async.submit(expressions[expression]);
+							break;
+						case 1:
+							async.submit(expressions[expression], callback);
+							break;
+						case 2:
+							accepted = async.try_submit(expressions[expression], request->m_future);
+							break;
+						default:
+							accepted = async.try_submit(expressions[expression], callback);
+							break;
+						}
+
+						if (accepted)
+							requests[t].push_back(std::move(request));
+						else
+							rejected++;
+					}
+				});
+			}
+
+			for (std::thread& thread : threads)
+				thread.join();
+
+			// nothing else is submitted, and the destructor has to finish
+			// everything that's still in flight
+			stats = async.stats();
+		}
+
+		size_t accepted = 0, completed = 0, tick_requests = 0;
+		std::set<double> tick_results;
+
+		for (const auto& thread_requests : requests)
+		{
+			for (const auto& request : thread_requests)
+			{
+				accepted++;
+
+				outcome_t outcome;
+				if (request->m_future.valid())
+				{
+					if (request->m_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+						continue;
+
+					try
+					{
+						outcome.m_result = request->m_future.get();
+					}
+					catch (...)
+					{
+						outcome.m_error = describe(std::current_exception());
+					}
+				}
+				else
+				{
+					if (!request->m_called)
+						continue;
+					outcome = request->m_outcome;
+				}
+
+				completed++;
+
+				const std::string expression = expressions[request->m_expression];
+				if (is_impure(expression))
+				{
+					tick_requests++;
+					tick_results.insert(outcome.m_result);
+				}
+				else if (!same(outcome, expected[request->m_expression]))
+				{
+					std::cout << "mismatch in round " << round << " on \"" << expression << "\"" << std::endl;
+					std::cout << "expected " << (expected[request->m_expression].m_error.empty() ? std::to_string(expected[request->m_expression].m_result) : expected[request->m_expression].m_error) << std::endl;
+					std::cout << "got " << (outcome.m_error.empty() ? std::to_string(outcome.m_result) : outcome.m_error) << std::endl;
+					return 1;
+				}
+			}
+		}
+
+		if (stats.m_submitted != accepted || stats.m_rejected != rejected || completed != stats.m_submitted)
+		{
+			std::cout << "round " << round << ": " << accepted << " accepted and " << completed << " completed, but "
+				<< stats.m_submitted << " submitted, " << rejected << " rejected but " << stats.m_rejected << " counted" << std::endl;
+			return 1;
+		}
+
+		if (ticks != tick_requests || tick_results.size() != tick_requests)
+		{
+			std::cout << "round " << round << ": " << tick_requests << " impure requests, but " << ticks << " calls and "
+				<< tick_results.size() << " distinct results" << std::endl;
+			return 1;
+		}
+
+		std::cout << "round " << round << ", queue " << options.m_queue_capacity << ", cache " << options.m_cache_size << ", " << options.m_evaluate_threads << " evaluating: "
+			<< completed << " completed, " << rejected << " rejected" << std::endl;
+	}
+
+	std::cout << "all rounds agree" << std::endl;
+	return 0;
+}
@@ -0,0 +1,239 @@
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <random>
+#include <string>
+#include "eval/evaluator.h"
+
+// differential test, the simd lexer should give exactly the same tokens (or the
+// same error) as the scalar one for any input
+
+namespace
+{
+
+std::string random_expression(std::mt19937& rng)
+{
+	static const char* const fragments[] = {
+		"sqrt", "pow", "abs", "log", "exp", "pi", "e", "x", "y", "rate", "x1", "sqrtx", "unknown",
+		"averyveryverylongvariablename", "averyveryverylongvariablenamethatsnotregistered",
+		"1", "2.5", "1e3", "0.000123", "12345678901234567890", "7.", "3e", "0x1F",
+		"+", "-", "*", "/", "%", "(", ")", "|", ",", "!", "#", "\xE9", "\xA0",
+	};
+
+	static const char whitespace[] = " \t\n\r\v\f";
+
+	std::string expression;
+	const size_t pieces = rng() % 40;
+
+	for (size_t i = 0; i < pieces; i++)
+	{
+		switch (rng() % 4)
+		{
+		case 0:
+		{
+			// long whitespace runs cross the 16 byte blocks
+			const size_t length = rng() % 40;
+			for (size_t j = 0; j < length; j++)
+				expression += whitespace[rng() % 6];
+			break;
+		}
+		case 1:
+			expression += static_cast<char>(rng() % 256);
+			break;
+		default:
+			expression += fragments[rng() % (sizeof(fragments) / sizeof(fragments[0]))];
+			break;
+		}
+	}
+
+	return expression;
+}
+
+std::string random_whitespace(std::mt19937& rng)
+{
+	static const char whitespace[] = " \t\n\r\v\f";
+
+	std::string spaces;
+	const size_t length = rng() % 4 == 0 ? rng() % 40 : 0;
+	for (size_t j = 0; j < length; j++)
+		spaces += whitespace[rng() % 6];
+	return spaces;
+}
+
+// plain decimals of up to 18 digits, either side of the 15 the simd lexer
+// works out itself rather than leaving to strtod
+std::string random_number(std::mt19937& rng)
+{
+	std::string number;
+	const size_t digits = 1 + rng() % 18;
+	const size_t point = rng() % 2 == 0 ? rng() % (digits + 1) : digits + 1;
+
+	for (size_t i = 0; i < digits; i++)
+	{
+		if (i == point)
+			number += i == 0 ? "0." : ".";
+		number += static_cast<char>('0' + rng() % 10);
+	}
+	if (point == digits)
+		number += ".";
+
+	return number;
+}
+
+// mostly well formed, so the successful paths get exercised as well
+std::string random_valid_expression(std::mt19937& rng, const int depth)
+{
+	static const char* const values[] = {
+		"x", "y", "rate", "pi", "e", "averyveryverylongvariablename", "1", "2.5", "1e3", "0.000123", "42",
+	};
+	static const char* const operators = "+-*/";
+
+	std::string expression;
+	const size_t terms = 1 + rng() % 4;
+
+	for (size_t i = 0; i < terms; i++)
+	{
+		if (i > 0)
+			expression += random_whitespace(rng) + operators[rng() % 4] + random_whitespace(rng);
+
+		if (rng() % 4 == 0)
+			expression += "-";
+
+		switch (depth > 0 ? rng() % 5 : 0)
+		{
+		case 0:
+			if (rng() % 3 == 0)
+				expression += random_number(rng);
+			else
+				expression += values[rng() % (sizeof(values) / sizeof(values[0]))];
+			break;
+		case 1:
+			expression += "(" + random_valid_expression(rng, depth - 1) + ")";
+			break;
+		case 2:
+			expression += "|" + random_valid_expression(rng, depth - 1) + "|";
+			break;
+		case 3:
+			expression += "sqrt(" + random_valid_expression(rng, depth - 1) + ")";
+			break;
+		case 4:
+			expression += "pow(" + random_valid_expression(rng, depth - 1) + "," + random_whitespace(rng) + random_valid_expression(rng, depth - 1) + ")";
+			break;
+		}
+
+		if (rng() % 8 == 0)
+			expression += "%";
+	}
+
+	return expression;
+}
+
+bool same_tokens(const std::list<eval::token_t>& a, const std::list<eval::token_t>& b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	for (auto a_it = a.begin(), b_it = b.begin(); a_it != a.end(); ++a_it, ++b_it)
+	{
+		if (a_it->m_type != b_it->m_type)
+			return false;
+
+		switch (a_it->m_type)
+		{
+		case eval::token_type::NUMBER:
+			if (std::memcmp(&a_it->m_value, &b_it->m_value, sizeof(double)) != 0)
+				return false;
+			break;
+		case eval::token_type::CONSTANT:
+		case eval::token_type::FUNCTION:
+		case eval::token_type::VARIABLE:
+			if (a_it->m_id != b_it->m_id)
+				return false;
+			break;
+		default:
+			if (a_it->m_symbol != b_it->m_symbol)
+				return false;
+			break;
+		}
+	}
+
+	return true;
+}
+
+std::string parse(const eval::evaluator_t& evaluate, const std::string& expression, std::list<eval::token_t>& tokens)
+{
+	try
+	{
+		tokens = evaluate.parse(expression);
+		return "";
+	}
+	catch (const eval::parse_exception& e)
+	{
+		return e.what();
+	}
+}
+
+}
+
+int main(int argc, char const* argv[])
+{
+	eval::evaluator_t scalar;
+
+	scalar.add_operator(eval::operators::add);
+	scalar.add_operator(eval::operators::subtract);
+	scalar.add_operator(eval::operators::multiply);
+	scalar.add_operator(eval::operators::divide);
+
+	scalar.add_unary(eval::unary::plus);
+	scalar.add_unary(eval::unary::minus);
+	scalar.add_unary(eval::unary::percent);
+
+	scalar.add_function(eval::functions::abs);
+	scalar.add_function(eval::functions::sqrt);
+	scalar.add_function(eval::functions::pow);
+	scalar.add_function(eval::functions::log);
+	scalar.add_function(eval::functions::exp);
+
+	scalar.add_constant(eval::constants::pi);
+	scalar.add_constant(eval::constants::e);
+
+	scalar.add_variable("x");
+	scalar.add_variable("y");
+	scalar.add_variable("rate");
+	scalar.add_variable("averyveryverylongvariablename");
+
+	scalar.associate_pipe_with_implicit_function("abs");
+
+	eval::evaluator_t simd = scalar;
+
+	scalar.set_lexer(eval::lexer_t::scalar);
+	simd.set_lexer(eval::lexer_t::simd);
+
+	const size_t cases = argc > 1 ? std::stoul(argv[1]) : 200000;
+
+	std::mt19937 rng(12345);
+	size_t parsed = 0;
+
+	for (size_t i = 0; i < cases; i++)
+	{
+		const std::string expression = i % 2 == 0 ? random_expression(rng) : random_valid_expression(rng, 3);
+
+		std::list<eval::token_t> scalar_tokens, simd_tokens;
+		const std::string scalar_error = parse(scalar, expression, scalar_tokens);
+		const std::string simd_error = parse(simd, expression, simd_tokens);
+
+		if (scalar_error != simd_error || !same_tokens(scalar_tokens, simd_tokens))
+		{
+			std::cout << "mismatch on case " << i << ": \"" << expression << "\"" << std::endl;
+			std::cout << "scalar: " << (scalar_error.empty() ? "ok" : scalar_error) << std::endl;
+			std::cout << "simd: " << (simd_error.empty() ? "ok" : simd_error) << std::endl;
+			return 1;
+		}
+
+		if (scalar_error.empty())
+			parsed++;
+	}
+
+	std::cout << cases << " cases agree, " << parsed << " of which parsed" << std::endl;
+	return 0;
+}
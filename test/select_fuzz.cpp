@@ -0,0 +1,168 @@
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "eval/evaluator.h"
+#include "eval/task_pool.h"
+
+// differential test, every way of evaluating a program should agree on random
+// expressions full of nested selects, against a reference which evaluates both
+// branches of every select and picks one afterwards
+
+namespace
+{
+
+double pick(const double* args) { return args[0] != 0 ? args[1] : args[2]; }
+
+// log for the reference, which evaluates the branch a select would have skipped
+double unguarded_log(const double* args) { return args[0] > 0 ? std::log(args[0]) : 0; }
+
+// the same random choices give the expression and its reference, the only
+// difference being select and log against pick and unguardedlog
+std::string random_expression(std::mt19937& rng, const int depth, const bool reference)
+{
+	// inf*0 gives the default NaN, which on x86 has its sign bit set
+	static const char* const values[] = { "x", "y", "0", "1", "2", "3", "(inf*0)" };
+	static const char* const operators[] = { "+", "-", "*", "<", ">", "=" };
+
+	switch (depth > 0 ? rng() % 6 : 0)
+	{
+	case 0:
+		return values[rng() % (sizeof(values) / sizeof(values[0]))];
+	case 1:
+	{
+		const std::string a = random_expression(rng, depth - 1, reference);
+		const std::string b = random_expression(rng, depth - 1, reference);
+		return "(" + a + operators[rng() % (sizeof(operators) / sizeof(operators[0]))] + b + ")";
+	}
+	case 2:
+		return "-" + random_expression(rng, depth - 1, reference);
+	case 3:
+	{
+		// log only ever sees a positive argument if the select guarding it
+		// short circuits
+		const std::string guard = random_expression(rng, depth - 1, reference);
+		const std::string otherwise = random_expression(rng, depth - 1, reference);
+		if (reference)
+			return "pick(" + guard + " > 0, unguardedlog(" + guard + "), " + otherwise + ")";
+		return "select(" + guard + " > 0, log(" + guard + "), " + otherwise + ")";
+	}
+	default:
+	{
+		const std::string condition = random_expression(rng, depth - 1, reference);
+		const std::string a = random_expression(rng, depth - 1, reference);
+		const std::string b = random_expression(rng, depth - 1, reference);
+		return (reference ? "pick(" : "select(") + condition + ", " + a + ", " + b + ")";
+	}
+	}
+}
+
+// bit for bit, so a NaN has to come out with the same sign and payload too
+bool same(const double a, const double b)
+{
+	return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+}
+
+int main(int argc, char const* argv[])
+{
+	eval::evaluator_t portable;
+
+	portable.add_operator(eval::operators::add);
+	portable.add_operator(eval::operators::subtract);
+	portable.add_operator(eval::operators::multiply);
+	portable.add_operator(eval::operators::less);
+	portable.add_operator(eval::operators::greater);
+	portable.add_operator(eval::operators::equal);
+
+	portable.add_unary(eval::unary::minus);
+
+	portable.add_function(eval::functions::select);
+	portable.add_function(eval::functions::log);
+	portable.add_function(eval::function_info_t("pick", 3, pick));
+	portable.add_function(eval::function_info_t("unguardedlog", 1, unguarded_log));
+
+	portable.add_constant(eval::constant_info_t("inf", INFINITY));
+
+	portable.add_variable("x");
+	portable.add_variable("y");
+
+	eval::task_pool_t task_pool(3);
+
+	eval::evaluator_t threaded = portable;
+	eval::evaluator_t parallel = portable;
+
+	portable.set_dispatch(eval::dispatch_t::portable);
+	threaded.set_dispatch(eval::dispatch_t::threaded);
+
+	// a threshold of 0 splits every program that can be split
+	parallel.set_parallelism(&task_pool, 0);
+
+	// every combination of small values, so comparisons come out both ways
+	std::vector<double> xs, ys;
+	for (int x = -2; x <= 2; x++)
+	{
+		for (int y = 0; y <= 2; y++)
+		{
+			xs.push_back(x);
+			ys.push_back(y);
+		}
+	}
+
+	const size_t rows = xs.size();
+	const double* const columns[] = { xs.data(), ys.data() };
+
+	const size_t cases = argc > 1 ? std::stoul(argv[1]) : 20000;
+
+	std::mt19937 rng(12345);
+
+	std::vector<double> batch_results(rows);
+	const auto batch_valid = std::make_unique<bool[]>(rows);
+
+	for (size_t i = 0; i < cases; i++)
+	{
+		const std::mt19937 state = rng;
+		const std::string expression = random_expression(rng, 5, false);
+		rng = state;
+		const std::string reference = random_expression(rng, 5, true);
+
+		const eval::program_t program = portable.compile(expression);
+		const eval::program_t reference_program = portable.compile(reference);
+
+		portable.evaluate(program, rows, columns, batch_results.data(), batch_valid.get());
+
+		for (size_t r = 0; r < rows; r++)
+		{
+			const double variables[] = { xs[r], ys[r] };
+			const double expected = portable.evaluate(reference_program, variables);
+
+			const double results[] = {
+				portable.evaluate(program, variables),
+				threaded.evaluate(program, variables),
+				parallel.evaluate(program, variables),
+				batch_valid[r] ? batch_results[r] : NAN,
+				portable.evaluate(portable.specialise(program, { { "x", xs[r] } }), variables),
+				portable.evaluate(portable.specialise(program, { { "x", xs[r] }, { "y", ys[r] } })),
+			};
+
+			static const char* const names[] = { "portable", "threaded", "parallel", "batch", "specialised on x", "specialised on x and y" };
+
+			for (size_t j = 0; j < sizeof(results) / sizeof(results[0]); j++)
+			{
+				if (!same(results[j], expected))
+				{
+					std::cout << "mismatch on case " << i << ", x = " << xs[r] << ", y = " << ys[r] << ": \"" << expression << "\"" << std::endl;
+					std::cout << "expected " << expected << ", " << names[j] << " gave " << results[j] << std::endl;
+					return 1;
+				}
+			}
+		}
+	}
+
+	std::cout << cases << " cases agree over " << rows << " rows each" << std::endl;
+	return 0;
+}
@@ -9,6 +9,9 @@ int main(int argc, char const* argv[])
 	evaluate.add_operator(eval::operators::subtract);
 	evaluate.add_operator(eval::operators::multiply);
 	evaluate.add_operator(eval::operators::divide);
+	evaluate.add_operator(eval::operators::less);
+	evaluate.add_operator(eval::operators::greater);
+	evaluate.add_operator(eval::operators::equal);
 
 	evaluate.add_unary(eval::unary::plus);
 	evaluate.add_unary(eval::unary::minus);
@@ -19,6 +22,7 @@ int main(int argc, char const* argv[])
 	evaluate.add_function(eval::functions::pow);
 	evaluate.add_function(eval::functions::log);
 	evaluate.add_function(eval::functions::exp);
+	evaluate.add_function(eval::functions::select);
 
 	evaluate.add_constant(eval::constants::pi);
 	evaluate.add_constant(eval::constants::e);